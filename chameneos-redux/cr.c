@@ -4,18 +4,45 @@
    contributed by Ryan Flynn
    
    process-based concurrency via fork()
-   IPC via pipe()/read()/write()
+   IPC via pipe()/read()/write() through a broker (-e pipe, or
+   -e batch with requests multiplexed onto one pipe), or
+   through a meeting place word in shared memory (-e shm);
+   or thread-based, meeting through the same word (-e thread)
 */
 
+#define _GNU_SOURCE /* syscall, MAP_ANONYMOUS */
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#define SPIN  1024 /* polls before yielding, given spare CPUs */
+#define YIELD 64   /* yields before sleeping on a futex */
+#define STACKSZ (64 * 1024) /* per creature thread */
+#define EVENTS  256         /* ready creatures the broker takes at once */
+#define BATCH   256         /* requests the batch broker reads at once */
+#define GAMES_MAX  64       /* -n creature counts */
+#define COLORS_MAX 256      /* -c colors given, repeated over the creatures */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
 enum Color {
   blue, red, yellow, COLOR_CNT
 };
@@ -58,7 +85,7 @@ static void printColors(void)
 struct Creature
 {
   struct Meet {
-    unsigned   id:12,
+    unsigned   id:30,
                two_met:1,
                same_id:1;
     enum Color color;
@@ -87,8 +114,6 @@ static inline const char * Creature_init(struct Creature *cr,
   cr->meet.id = ++CreatureID;
   cr->meet.color = color;
   cr->meet.two_met = false;
-  pipe(cr->from);
-  pipe(cr->to);
   return ColorName[color];
 }
 
@@ -103,15 +128,110 @@ static inline void Meet_merge(const struct Meet *src, struct Meet *dst)
     dst->sameCnt++;
 }
 
+/*
+ * placement: which CPU the broker (slot 0) and each creature (slot
+ * i + 1) run on, from the CPUs we may use, per policy
+ *   any     wherever the scheduler likes
+ *   one     all on one CPU
+ *   core    one per physical core, SMT siblings left idle
+ *   llc     the CPUs sharing the first one's last level cache
+ *   spread  round robin over last level caches, hence over sockets
+ */
+enum Placement { ANY, ONE, CORE, LLC, SPREAD, PLACEMENT_CNT };
+
+static const char *PlacementName[PLACEMENT_CNT] = {
+  "any", "one", "core", "llc", "spread"
+};
+
+static enum Placement Placement = ANY;
+static int           *Slot;
+static unsigned       SlotCnt;
+
+struct Cpu {
+  int cpu, pkg, core, llc,
+      rank; /* CPUs of the same llc before this one */
+};
+
+/* first number in a sysfs file of cpu's, or -1 */
+static int sysfsInt(const int cpu, const char *leaf)
+{
+  char path[128];
+  int v = -1;
+  snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/%s", cpu, leaf);
+  FILE *f = fopen(path, "r");
+  if (f) {
+    if (1 != fscanf(f, "%d", &v))
+      v = -1;
+    fclose(f);
+  }
+  return v;
+}
+
+static int Cpu_cmpSpread(const void *a, const void *b)
+{
+  const struct Cpu *x = a, *y = b;
+  return x->rank != y->rank ? x->rank - y->rank :
+         x->llc != y->llc   ? x->llc - y->llc   : x->cpu - y->cpu;
+}
+
+static void Placement_init(void)
+{
+  cpu_set_t set;
+  struct Cpu *v = calloc(CPU_SETSIZE, sizeof *v);
+  unsigned cnt = 0;
+  sched_getaffinity(0, sizeof set, &set);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &set))
+      continue;
+    struct Cpu *x = v + cnt++;
+    x->cpu = cpu;
+    x->pkg = sysfsInt(cpu, "topology/physical_package_id");
+    x->core = sysfsInt(cpu, "topology/core_id");
+    /* an llc is named by its first CPU; without one, by its package */
+    if (-1 == (x->llc = sysfsInt(cpu, "cache/index3/shared_cpu_list")))
+      x->llc = x->pkg;
+    for (const struct Cpu *y = v; y < x; y++)
+      x->rank += y->llc == x->llc;
+  }
+  Slot = malloc(cnt * sizeof *Slot);
+  for (unsigned i = 0; i < cnt; i++) {
+    bool keep = ONE != Placement || !SlotCnt;
+    if (CORE == Placement)
+      for (unsigned j = 0; j < i; j++)
+        keep &= v[j].pkg != v[i].pkg || v[j].core != v[i].core;
+    if (LLC == Placement)
+      keep = v[i].llc == v[0].llc;
+    if (keep)
+      v[SlotCnt++] = v[i];
+  }
+  if (SPREAD == Placement)
+    qsort(v, SlotCnt, sizeof *v, Cpu_cmpSpread);
+  for (unsigned i = 0; i < SlotCnt; i++)
+    Slot[i] = v[i].cpu;
+  free(v);
+}
+
+/* move the calling process or thread to its slot's CPU */
+static void place(const unsigned slot)
+{
+  cpu_set_t set;
+  if (ANY == Placement)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(Slot[slot % SlotCnt], &set);
+  if (sched_setaffinity(0, sizeof set, &set))
+    perror("sched_setaffinity");
+}
+
 static inline void runCreature(struct Creature *c)
 {
-  struct Meet m;
+  struct Meet m, me = c->meet; /* c is the broker's */
   do {
-    write(c->to[1], &c->meet, sizeof m); /* request meeting  */
+    write(c->to[1], &me, sizeof m);      /* request meeting  */
     read(c->from[0], &m, sizeof m);      /* meeting result   */
-    Meet_merge(&m, &c->meet);            /* update state     */
+    Meet_merge(&m, &me);                 /* update state     */
   } while (m.two_met);
-  write(c->to[1], &c->meet, sizeof m);   /* send final state */
+  write(c->to[1], &me, sizeof m);        /* send final state */
   exit(0);
 }
 
@@ -142,36 +262,316 @@ static inline void doneMeetings(const int n, struct Creature *c)
 
 static void doMeetings(int meetings, const int n, struct Creature *c)
 {
-  const int maxfd = c[n-1].to[0];
-  int i, metcnt = 0;
+  struct epoll_event ev[EVENTS];
+  struct Creature *met = NULL; /* read, waiting for a partner */
+  const int ep = epoll_create1(0);
+  if (ep < 0)
+    perror("epoll_create1"), exit(1);
+  /* monitor creatures' meeting requests */
+  for (int i = 0; i < n; i++) {
+    struct epoll_event e = { EPOLLIN | EPOLLET, { .u32 = i } };
+    fcntl(c[i].to[0], F_SETFL, O_NONBLOCK);
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, c[i].to[0], &e))
+      perror("epoll_ctl"), exit(1);
+  }
   while (meetings) {
-    struct Creature *met[2];
-    fd_set rd;
-    FD_ZERO(&rd);
-    /* monitor creatures' meeting requests */
-    for (i = 0; i < n; i++)
-      if (!metcnt || met[0] != c+i)
-        FD_SET(c[i].to[0], &rd);
-    if (select(maxfd+1, &rd, NULL, NULL, NULL) <= 0)
-      continue;
+    const int k = epoll_wait(ep, ev, EVENTS, -1);
     /* meet() any two willing creatures */
-    for (i = 0; i < n; i++) {
-      if (!FD_ISSET(c[i].to[0], &rd))
+    for (int j = 0; j < k && meetings; j++) {
+      struct Creature *cr = c + ev[j].data.u32;
+      /* edge triggered, yet one read drains it: a creature has one
+       * request at most outstanding, waiting for the answer to send
+       * its next, and that arrives as a new edge */
+      if (read(cr->to[0], &cr->meet, sizeof cr->meet) <= 0)
+        continue;
+      if (!met) {
+        met = cr;
         continue;
-      if (read(c[i].to[0], &c[i].meet, sizeof c[i].meet) > 0) {
-        met[metcnt++] = c+i;
-        if (metcnt == 2) {
-          meet(met[0], met[1]);
-          metcnt = 0;
-          if (--meetings == 0)
-            break;
-        }
       }
+      meet(met, cr);
+      met = NULL;
+      --meetings;
     }
   }
+  close(ep);
+  for (int i = 0; i < n; i++)
+    fcntl(c[i].to[0], F_SETFL, 0);
   doneMeetings(n, c);
 }
 
+/* pipe engine: each creature a process talking to the broker */
+static void pipeGame(int meetings, const unsigned n, struct Creature *c)
+{
+  /* two fds a creature: lift the soft limit for big games */
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max)
+    rl.rlim_cur = rl.rlim_max, setrlimit(RLIMIT_NOFILE, &rl);
+  for (unsigned i = 0; i < n; i++) {
+    if (pipe(c[i].from) || pipe(c[i].to))
+      perror("pipe"), exit(1);
+    if (0 == fork())
+      place(i + 1), runCreature(c+i);
+    close(c[i].from[0]), close(c[i].to[1]); /* creature's ends */
+  }
+  doMeetings(meetings, n, c);
+  for (unsigned i = 0; i < n; i++)
+    close(c[i].from[1]), close(c[i].to[0]);
+}
+
+/*
+ * batch engine: like pipe, but creatures send requests down one pipe
+ * they share, so a read takes every request pending in it. requests fit
+ * in PIPE_BUF, so their writes never interleave. answers still take a
+ * write each, as every creature reads its own pipe
+ */
+static void batchCreature(struct Creature *c, const int req)
+{
+  struct Meet m, me = c->meet;
+  for (;;) {
+    write(req, &me, sizeof me);          /* request meeting  */
+    read(c->from[0], &m, sizeof m);      /* meeting result   */
+    if (!m.two_met)
+      exit(0);                           /* game over        */
+    Meet_merge(&m, &me);                 /* update state     */
+  }
+}
+
+static void batchGame(int meetings, const unsigned n, struct Creature *c)
+{
+  struct Meet req[BATCH];
+  struct Creature *met = NULL;   /* read, waiting for a partner */
+  const unsigned first = c[0].meet.id;
+  unsigned waiting = 0;          /* requests read, not answered */
+  struct rlimit rl;
+  int fd[2];
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max)
+    rl.rlim_cur = rl.rlim_max, setrlimit(RLIMIT_NOFILE, &rl);
+  if (pipe(fd))
+    perror("pipe"), exit(1);
+  for (unsigned i = 0; i < n; i++) {
+    if (pipe(c[i].from))
+      perror("pipe"), exit(1);
+    if (0 == fork())
+      place(i + 1), batchCreature(c+i, fd[1]);
+    close(c[i].from[0]);
+  }
+  close(fd[1]);
+  /* once meetings run out, every creature's last request holds its
+   * final state; read on until there is one from each */
+  while (meetings || waiting < n) {
+    const ssize_t r = read(fd[0], req, sizeof req);
+    if (r <= 0)
+      perror("read"), exit(1);
+    for (unsigned k = 0; k < r / sizeof *req; k++) {
+      struct Creature *cr = c + (req[k].id - first);
+      cr->meet = req[k];
+      waiting++;
+      if (!meetings)
+        continue;
+      if (!met) {
+        met = cr;
+        continue;
+      }
+      meet(met, cr);
+      met = NULL;
+      waiting -= 2;
+      meetings--;
+    }
+  }
+  close(fd[0]);
+  for (unsigned i = 0; i < n; i++) {
+    struct Meet done = c[i].meet;
+    done.two_met = false;
+    write(c[i].from[1], &done, sizeof done);
+    close(c[i].from[1]);
+  }
+  for (int _, i = 0; i < (int)n; i++)
+    wait(&_);
+}
+
+/*
+ * shm and thread engines: no broker. creatures meet through one word,
+ * meetings left in the high half and in the low half the creature
+ * waiting there, if any: its index + 1 and its color. a creature either
+ * CASes itself into an empty place and waits on its mailbox, or CASes
+ * the waiter out, counting off a meeting, and posts to the waiter's
+ * mailbox. the engines differ only in creatures being processes sharing
+ * a mapping, or threads
+ */
+#define PLACE(left, i, color) ((unsigned long long)(left) << 32 | \
+                               (unsigned)((i) + 1) << 2 | (color))
+#define PLACE_LEFT(s)         ((unsigned)((s) >> 32))
+#define PLACE_WAITER(s)       (((unsigned)(s) >> 2) - 1)
+#define PLACE_COLOR(s)        ((enum Color)((s) & 3))
+
+struct Mailbox {
+  unsigned   full;  /* futex word: EMPTY, POSTED or SLEEPING */
+  enum Color color; /* partner's */
+  unsigned   id;
+} __attribute__((aligned(64)));
+
+enum { EMPTY, POSTED, SLEEPING };
+
+struct Shared {
+  unsigned long long place __attribute__((aligned(64)));
+  int                priv;  /* FUTEX_PRIVATE_FLAG if not shared */
+  struct Creature   *c;
+  struct Mailbox     box[];
+};
+
+static unsigned Spin; /* 0 on one CPU: the partner can't run meanwhile */
+
+static inline void futex_wait(const struct Shared *sh, unsigned *addr,
+                              unsigned val)
+{
+  syscall(SYS_futex, addr, FUTEX_WAIT | sh->priv, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(const struct Shared *sh, unsigned *addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE | sh->priv, 1, NULL, NULL, 0);
+}
+
+/* wait for a partner's post: spin a while, yield a while, then sleep */
+static inline void Mailbox_wait(const struct Shared *sh, struct Mailbox *b)
+{
+  unsigned v = EMPTY;
+  for (unsigned i = 0; i < Spin + YIELD; i++) {
+    if (EMPTY != __atomic_load_n(&b->full, __ATOMIC_ACQUIRE))
+      goto posted;
+    if (i < Spin)
+      cpu_relax();
+    else
+      sched_yield();
+  }
+  if (__atomic_compare_exchange_n(&b->full, &v, SLEEPING, false,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    while (SLEEPING == __atomic_load_n(&b->full, __ATOMIC_ACQUIRE))
+      futex_wait(sh, &b->full, SLEEPING);
+posted:
+  __atomic_store_n(&b->full, EMPTY, __ATOMIC_RELAXED);
+}
+
+static inline void Mailbox_post(const struct Shared *sh, struct Mailbox *b,
+                                const struct Meet *m)
+{
+  b->color = m->color;
+  b->id = m->id;
+  if (SLEEPING == __atomic_exchange_n(&b->full, POSTED, __ATOMIC_RELEASE))
+    futex_wake(sh, &b->full);
+}
+
+/* creature i meets until no meetings are left */
+static void placeMeetings(struct Shared *sh, const unsigned i)
+{
+  struct Meet *m = &sh->c[i].meet;
+  unsigned long long s = __atomic_load_n(&sh->place, __ATOMIC_ACQUIRE);
+  while (PLACE_LEFT(s)) {
+    enum Color color;
+    unsigned id;
+    if (!(unsigned)s) {
+      if (!__atomic_compare_exchange_n(&sh->place, &s,
+                                       PLACE(PLACE_LEFT(s), i, m->color),
+                                       true, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE))
+        continue;
+      Mailbox_wait(sh, sh->box + i);
+      color = sh->box[i].color;
+      id = sh->box[i].id;
+    } else {
+      const unsigned w = PLACE_WAITER(s);
+      if (!__atomic_compare_exchange_n(&sh->place, &s,
+                                       (unsigned long long)
+                                         (PLACE_LEFT(s) - 1) << 32,
+                                       true, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE))
+        continue;
+      color = PLACE_COLOR(s);
+      id = sh->c[w].meet.id;
+      Mailbox_post(sh, sh->box + w, m);
+    }
+    m->color = Compliment[m->color][color];
+    m->cnt++;
+    m->sameCnt += id == m->id;
+    s = __atomic_load_n(&sh->place, __ATOMIC_ACQUIRE);
+  }
+}
+
+static struct Shared * Shared_new(int meetings, const unsigned n,
+                                  struct Creature *c, const int priv)
+{
+  const size_t size = sizeof(struct Shared) + n * sizeof(struct Mailbox);
+  struct Shared *sh = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == sh)
+    perror("mmap"), exit(1);
+  sh->place = (unsigned long long)meetings << 32;
+  sh->priv = priv;
+  sh->c = c;
+  return sh;
+}
+
+static void Shared_free(struct Shared *sh, const unsigned n)
+{
+  munmap(sh, sizeof(struct Shared) + n * sizeof(struct Mailbox));
+}
+
+/* shm engine: each creature a process */
+static void shmGame(int meetings, const unsigned n, struct Creature *c)
+{
+  struct Shared *sh = Shared_new(meetings, n, c, 0);
+  for (unsigned i = 0; i < n; i++)
+    if (0 == fork())
+      place(i + 1), placeMeetings(sh, i), exit(0);
+  for (int _, i = 0; i < (int)n; i++)
+    wait(&_);
+  Shared_free(sh, n);
+}
+
+/* thread engine: each creature a thread */
+struct Thread {
+  pthread_t      t;
+  struct Shared *sh;
+  unsigned       i;
+};
+
+static void * threadCreature(void *arg)
+{
+  const struct Thread *t = arg;
+  place(t->i + 1);
+  placeMeetings(t->sh, t->i);
+  return NULL;
+}
+
+static void threadGame(int meetings, const unsigned n, struct Creature *c)
+{
+  struct Shared *sh = Shared_new(meetings, n, c, FUTEX_PRIVATE_FLAG);
+  struct Thread *t = calloc(n, sizeof *t);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, STACKSZ);
+  for (unsigned i = 0; i < n; i++) {
+    t[i].sh = sh, t[i].i = i;
+    if (pthread_create(&t[i].t, &attr, threadCreature, t + i))
+      perror("pthread_create"), exit(1);
+  }
+  for (unsigned i = 0; i < n; i++)
+    pthread_join(t[i].t, NULL);
+  pthread_attr_destroy(&attr);
+  free(t);
+  Shared_free(sh, n);
+}
+
+static const struct Engine {
+  const char *name;
+  void      (*game)(int meetings, const unsigned n, struct Creature *c);
+} Engines[] = {
+  { "pipe",   pipeGame   },
+  { "batch",  batchGame  },
+  { "shm",    shmGame    },
+  { "thread", threadGame }
+}, *Engine = Engines;
+
 /* print per creature and total meet count */
 static inline void printResults(const unsigned n, const struct Creature *c)
 {
@@ -182,35 +582,141 @@ static inline void printResults(const unsigned n, const struct Creature *c)
   printf(" %s\n\n", formatNumber(total, str));
 }
 
-static void initGame(int meetings, const unsigned n, const enum Color *color)
+/* play one game; returns how long the meetings took, in seconds */
+static double initGame(int meetings, const unsigned n,
+                       const enum Color *color, const unsigned colorCnt,
+                       const bool quiet)
 {
   unsigned i;
-  struct Creature *c = calloc(n, sizeof *c);
+  /* shared, so creatures' final state is visible whatever the engine */
+  const size_t size = n * sizeof(struct Creature);
+  struct Creature *c = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == c)
+    perror("mmap"), exit(1);
   /* initial creature color */
-  for (i = 0; i < n; i++)
-    printf("%s ", Creature_init(c+i, color[i]));
-  fputc('\n', stdout);
-  /* launch creatures */
-  for (i = 0; i < n; i++)
-    if (0 == fork())
-      runCreature(c+i);
-  doMeetings(meetings, n, c);
-  printResults(n, c);
-  free(c);
+  for (i = 0; i < n; i++) {
+    const char *name = Creature_init(c+i, color[i % colorCnt]);
+    if (!quiet)
+      printf("%s ", name);
+  }
+  if (!quiet)
+    fputc('\n', stdout);
+  fflush(stdout); /* or each child would flush its own copy */
+  cpu_set_t set;
+  struct timespec t0, t1;
+  sched_getaffinity(0, sizeof set, &set);
+  place(0);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  Engine->game(meetings, n, c);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  sched_setaffinity(0, sizeof set, &set);
+  const double secs = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  if (ANY != Placement && !quiet)
+    fprintf(stderr, "%s, %s: %u creatures, %.0f meetings/s\n",
+            Engine->name, PlacementName[Placement], n, meetings / secs);
+  if (!quiet)
+    printResults(n, c);
+  munmap(c, size);
+  return secs;
+}
+
+static const char Usage[] =
+  "usage: %s [-e pipe|batch|shm|thread] [-a any|one|core|llc|spread]\n"
+  "          [-n creatures,...] [-c color,...] [-g games] [-s from:to]"
+  " [meetings]\n"
+  "  -e  how creatures meet (pipe)\n"
+  "  -a  place broker and creatures on CPUs, reporting meetings/s\n"
+  "  -n  a game of each many creatures, 2 or more (3,10)\n"
+  "  -c  initial colors, repeated over the creatures\n"
+  "      (blue,red,yellow,red,yellow,blue,red,yellow,red,blue)\n"
+  "  -g  play the games this many times (1)\n"
+  "  -s  instead, print meetings/s for from, twice from ... to creatures,\n"
+  "      from 2 or more\n";
+
+/* index of name in names[cnt], or -1 */
+static int lookup(const char *name, const char *const *names, int cnt)
+{
+  while (cnt-- && strcmp(name, names[cnt]))
+    ;
+  return cnt;
 }
 
 int main(int argc, char* argv[])
 {
-  const enum Color r[] = {
+  enum Color color[COLORS_MAX] = {
    blue, red,    yellow,
    red,  yellow, blue,
    red,  yellow, red,
    blue
   };
-  int n = (argc == 2) ? atoi(argv[1]) : 600;
+  unsigned game[GAMES_MAX] = { 3, 10 }, gameCnt = 2, colorCnt = 10,
+           repeat = 1, from = 0, to = 0;
+  const char *engine[sizeof Engines / sizeof Engines[0]];
+  const int engineCnt = sizeof engine / sizeof engine[0];
+  int opt, i, n = 600;
+  char *tok;
+  for (i = 0; i < engineCnt; i++)
+    engine[i] = Engines[i].name;
+  while (-1 != (opt = getopt(argc, argv, "e:a:n:c:g:s:"))) {
+    switch (opt) {
+    case 'e':
+      if (-1 == (i = lookup(optarg, engine, engineCnt)))
+        goto usage;
+      Engine = Engines + i;
+      break;
+    case 'a':
+      if (-1 == (i = lookup(optarg, PlacementName, PLACEMENT_CNT)))
+        goto usage;
+      Placement = (enum Placement)i;
+      break;
+    case 'n':
+      for (gameCnt = 0, tok = strtok(optarg, ","); tok;
+           tok = strtok(NULL, ","))
+        if (gameCnt == GAMES_MAX || (i = atoi(tok)) < 2)
+          goto usage; /* a lone creature would wait forever */
+        else
+          game[gameCnt++] = i;
+      break;
+    case 'c':
+      for (colorCnt = 0, tok = strtok(optarg, ","); tok;
+           tok = strtok(NULL, ","))
+        if (colorCnt == COLORS_MAX ||
+            -1 == (i = lookup(tok, ColorName, COLOR_CNT)))
+          goto usage;
+        else
+          color[colorCnt++] = (enum Color)i;
+      break;
+    case 'g':
+      repeat = atoi(optarg);
+      break;
+    case 's':
+      if (2 != sscanf(optarg, "%u:%u", &from, &to) || from < 2 || from > to)
+        goto usage;
+      break;
+    default:
+    usage:
+      return fprintf(stderr, Usage, argv[0]), 1;
+    }
+  }
+  if (optind < argc)
+    n = atoi(argv[optind]);
+  if (!colorCnt)
+    goto usage;
+  Placement_init();
+  /* spinning only pays with a CPU to spare for the partner */
+  Spin = (ANY == Placement ? sysconf(_SC_NPROCESSORS_ONLN) : SlotCnt) > 1 ?
+         SPIN : 0;
+  if (from) {
+    printf("# %s, %s: creatures meetings/s\n",
+           Engine->name, PlacementName[Placement]);
+    for (unsigned k = from; k <= to && k; k *= 2)
+      printf("%u %.0f\n", k, n / initGame(n, k, color, colorCnt, true));
+    return 0;
+  }
   printColors();
-  initGame(n, 3u, r);
-  initGame(n, sizeof r / sizeof r[0], r);
+  while (repeat--)
+    for (unsigned k = 0; k < gameCnt; k++)
+      initGame(n, game[k], color, colorCnt, false);
   return 0;
 }
-
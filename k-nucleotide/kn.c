@@ -5,69 +5,626 @@
  * contributed by Ryan Flynn
  */
 
-#include <ctype.h>
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
-#include "ht.h"
+#include "kt.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads()  1
+#define omp_get_num_threads()  1
+#define omp_get_thread_num()   0
+#endif
 
-#define BUFSZ          (1024 * 512UL)
-#define HT_BINS        (1024 * 1024 * 32UL) /* NOTE: power of 2 */
-#define MAX_ENTRIES    (HT_BINS * 2)
-#define dna_combo(nth) (1ULL << (2 * (nth)))
+#define BUFSZ          (1024 * 1024UL) /* stdin read size */
+/* saturates at nth = 32, where the key space is all 64 bits */
+#define dna_combo(nth) ((nth) < 32 ? 1ULL << (2 * (nth)) : ~0ULL)
+#define dna_mask(nth)  (~0ULL >> (64 - 2 * (nth))) /* 1 <= nth <= 32 */
 #define MIN(a, b)      ((a) < (b) ? (a) : (b))
+#define MAX(a, b)      ((a) > (b) ? (a) : (b))
+/* len-mers in seq, at most; fewer are counted if it has gaps */
+#define kmer_total(seq, nth) \
+  ((seq)->len >= (nth) ? (seq)->len - (nth) + 1 : 0)
+#define PREFETCH       16 /* positions ahead to fetch far count lines */
+#define NEAR_LEN       8  /* counts for len <= NEAR_LEN stay cache resident */
+/* key spaces up to this size are counted in a dense array indexed by
+ * packed code; above it, in a hash table */
+#ifndef DENSE_MAX
+#define DENSE_MAX      dna_combo(12)
+#endif
+
+/* either case: its code in the low 2 bits, and NUC_OK; anything else is
+ * 0, a gap in the sequence */
+#define NUC_OK 4
+
+static const unsigned char Nuc[UCHAR_MAX + 1] =
+{
+  ['A'] = NUC_OK | 0, ['a'] = NUC_OK | 0,
+  ['C'] = NUC_OK | 1, ['c'] = NUC_OK | 1,
+  ['G'] = NUC_OK | 2, ['g'] = NUC_OK | 2,
+  ['T'] = NUC_OK | 3, ['t'] = NUC_OK | 3,
+};
 
+/*
+ * the sequence, packed 4 nucleotides per byte as it is read, first in the
+ * low bits: a quarter of the memory of the text, and every pass over it
+ * a quarter of the bandwidth. a base that is not ACGT (N, say) packs as
+ * A, and its position goes in gap: no len-mer spanning it is counted
+ */
 struct buf {
-  char  *str;
-  size_t len, alloc;
+  unsigned char *pk;
+  size_t         len,   /* nucleotides */
+                 alloc; /* bytes */
+  size_t        *gap,   /* [ngap] ascending */
+                 ngap,
+                 gapalloc;
 };
 
-static void buf_init(struct buf *b)
+#define buf_nuc(b, i) (((b)->pk[(i) >> 2] >> (((i) & 3) * 2)) & 3)
+
+/* room for about hint nucleotides up front */
+static void buf_init(struct buf *b, size_t hint)
 {
   b->len = 0;
-  b->alloc = BUFSZ;
-  b->str = malloc(b->alloc);
+  b->alloc = hint / 4 + 1;
+  b->pk = malloc(b->alloc);
+  if (!b->pk)
+    perror("malloc"), exit(1);
+  b->gap = NULL;
+  b->ngap = b->gapalloc = 0;
+}
+
+static void buf_free(struct buf *b)
+{
+  free(b->pk);
+  free(b->gap);
+}
+
+/* append text c, the next nucleotide or a gap; the byte it lands in is
+ * already zeroed above it */
+static void buf_put(struct buf *b, unsigned char c)
+{
+  if (!(Nuc[c] & NUC_OK)) {
+    if (b->ngap == b->gapalloc) {
+      b->gapalloc = MAX(64, b->gapalloc * 2);
+      b->gap = realloc(b->gap, b->gapalloc * sizeof *b->gap);
+      if (!b->gap)
+        perror("realloc"), exit(1);
+    }
+    b->gap[b->ngap++] = b->len;
+  }
+  b->pk[b->len >> 2] |= (unsigned char)((Nuc[c] & 3) << ((b->len & 3) * 2));
+  b->len++;
+}
+
+/* index of the first gap at or after i */
+static size_t buf_gap(const struct buf *b, size_t i)
+{
+  size_t lo = 0, hi = b->ngap;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (b->gap[mid] < i)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
 }
 
-static void buf_grow(struct buf *b, size_t len)
+/* append n nucleotides of text s */
+static void buf_pack(struct buf *b, const char *s, size_t n)
 {
-  size_t newlen = b->len + len + BUFSZ;
-  if (newlen > b->alloc) {
-    b->alloc = newlen * 2;
-    b->str = realloc(b->str, b->alloc);
-    if (!b->str)
+  const unsigned char *u = (const unsigned char *)s;
+  if ((b->len + n) / 4 + 1 > b->alloc) {
+    b->alloc = MAX(b->alloc * 2, (b->len + n) / 4 + 1);
+    b->pk = realloc(b->pk, b->alloc);
+    if (!b->pk)
       perror("realloc"), exit(1);
   }
-  while (len--) /* uppercase */
-    b->str[b->len] = (char)toupper((int)b->str[b->len]), b->len++;
+  for (; n && (b->len & 3); n--)
+    buf_put(b, *u++);
+  unsigned char *w = b->pk + (b->len >> 2);
+  for (; n >= 4; n -= 4, u += 4, w++) {
+    const unsigned n0 = Nuc[u[0]], n1 = Nuc[u[1]],
+                   n2 = Nuc[u[2]], n3 = Nuc[u[3]];
+    if (n0 & n1 & n2 & n3 & NUC_OK) {
+      *w = (unsigned char)((n0 & 3)      | (n1 & 3) << 2 |
+                           (n2 & 3) << 4 | (n3 & 3) << 6);
+      b->len += 4;
+    } else {
+      *w = 0;
+      for (int i = 0; i < 4; i++)
+        buf_put(b, u[i]);
+    }
+  }
+  if (n)
+    *w = 0;
+  while (n--)
+    buf_put(b, *u++);
 }
 
-inline unsigned long dna_hash(const char *dna, unsigned len)
+/* fnv-1a over the packed sequence, then its length; ties an index to what
+ * it counted. a sequence seen a block at a time sums its bytes as it
+ * goes: sum_bytes from SUM_BASIS, then sum_len. the positions of any gaps
+ * are summed apart, sum_len of each from SUM_BASIS, and sum_gaps folds
+ * them in after */
+#define SUM_BASIS 0xCBF29CE484222325ULL
+
+static unsigned long long sum_bytes(unsigned long long h,
+                                    const unsigned char *p, size_t n)
 {
-  static const unsigned char X[UCHAR_MAX + 1] =
-  {
-    ['A'] = 0,
-    ['C'] = 1,
-    ['G'] = 2,
-    ['T'] = 3,
-  };
-  unsigned long h = 0;
+  while (n--)
+    h = (h ^ *p++) * 0x100000001B3ULL;
+  return h;
+}
+
+static unsigned long long sum_len(unsigned long long h, size_t len)
+{
+  return (h ^ len) * 0x100000001B3ULL;
+}
+
+static unsigned long long sum_gaps(unsigned long long h,
+                                   unsigned long long g, size_t ngap)
+{
+  return ngap ? sum_len(h ^ g, ngap) : h;
+}
+
+static unsigned long long buf_sum(const struct buf *b)
+{
+  unsigned long long g = SUM_BASIS;
+  for (size_t i = 0; i < b->ngap; i++)
+    g = sum_len(g, b->gap[i]);
+  return sum_gaps(sum_len(sum_bytes(SUM_BASIS, b->pk, (b->len + 3) / 4),
+                          b->len), g, b->ngap);
+}
+
+/* pack len <= 32 nucleotides 2 bits apiece; A < C < G < T so packed codes
+ * sort the same as their strings */
+static inline unsigned long long dna_hash(const char *dna, unsigned len)
+{
+  unsigned long long h = 0;
   while (len--)
-    h = (h << 2) | X[(unsigned char)*dna++];
+    h = (h << 2) | (Nuc[(unsigned char)*dna++] & 3);
   return h;
 }
 
-#define index(key, len) (dna_hash(key, len) & (HT_BINS - 1))
+/* packed code of the reverse complement of len-mer h */
+static inline unsigned long long dna_rc(unsigned long long h, unsigned len)
+{
+  unsigned long long r = 0;
+  for (; len--; h >>= 2)
+    r = (r << 2) | (3 ^ (h & 3));
+  return r;
+}
+
+/* unpack len nucleotides of h into dst */
+static char * dna_str(unsigned long long h, unsigned len, char *dst)
+{
+  dst[len] = '\0';
+  while (len--)
+    dst[len] = "ACGT"[h & 3], h >>= 2;
+  return dst;
+}
+
+/*
+ * a spill partition: a temporary file of raw codes, written through a
+ * small buffer, for a table counted a slice at a time
+ */
+#define PART_REC 1024 /* codes buffered per partition */
+
+struct part {
+  FILE               *f;
+  unsigned long long  n;    /* codes written */
+  unsigned            fill;
+  uint64_t            rec[PART_REC];
+};
+
+/* create a temporary file under $TMPDIR, named in path */
+static int tmp_open(char path[PATH_MAX])
+{
+  const char *dir = getenv("TMPDIR");
+  snprintf(path, PATH_MAX, "%s/kn.XXXXXX", dir && *dir ? dir : "/tmp");
+  return mkstemp(path);
+}
+
+/* an unlinked temporary file */
+static FILE * spill_file(void)
+{
+  char path[PATH_MAX];
+  int fd = tmp_open(path);
+  FILE *f = fd < 0 ? NULL : fdopen(fd, "w+b");
+  if (!f)
+    perror(path), exit(1);
+  unlink(path);
+  return f;
+}
+
+/* which of parts partitions key falls in at a given depth of splitting;
+ * each depth hashes afresh so a partition splits evenly again */
+static inline unsigned part_of(unsigned long long key, unsigned depth,
+                               unsigned parts)
+{
+  unsigned long long z = key + (depth + 1) * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return (unsigned)(((z >> 32) * parts) >> 32);
+}
+
+static void part_flush(struct part *p)
+{
+  if (p->fill && fwrite(p->rec, sizeof *p->rec, p->fill, p->f) != p->fill)
+    perror("spill"), exit(1);
+  p->n += p->fill;
+  p->fill = 0;
+}
+
+static inline void part_put(struct part *p, unsigned long long key)
+{
+  p->rec[p->fill++] = key;
+  if (p->fill == PART_REC)
+    part_flush(p);
+}
+
+/*
+ * counts of every len-mer: either dense, one counter per possible key, or
+ * kt shards holding only the keys seen; or, read back from an index, the
+ * keys seen in ascending order beside their counts; or, while counting in
+ * bounded memory, only spilled to partitions. a canonical count files
+ * each len-mer and its reverse complement under the lesser code.
+ *
+ * counting runs on every thread at once, each walking its own slice of
+ * seq. small dense counts are cheap to copy, so each thread counts its
+ * slice privately and sums in at the end; large counts are split by key
+ * instead, each thread owning one shard (a range of the dense array or
+ * one kt) outright and applying the codes every thread queued for it
+ */
+/* each shard's kt on its own line; only its owner writes it */
+union kshard {
+  struct kt t;
+  char      line[KT_LINE];
+};
+
+/* one thread's codes for a large count, a batch at a time: as walked,
+ * then grouped by the thread owning their shard */
+#define KQ_BATCH (1 << 16) /* positions walked between hand-offs */
+
+struct kq {
+  uint64_t *raw,  /* [KQ_BATCH] */
+           *key;  /* [KQ_BATCH] */
+  size_t    n,
+           *off;  /* [nth + 1], key[off[t]..off[t + 1]) go to thread t */
+};
+
+struct kcnt {
+  unsigned            len,
+                      shards;
+  unsigned long long  mask;
+  unsigned long      *dense;
+  union kshard       *t;      /* [shards] */
+  int                 far,    /* large enough to shard and prefetch */
+                      canon;  /* keyed by canonical code */
+  const uint64_t     *key,    /* [n] sorted, from an index */
+                     *cnt;    /* [n] */
+  size_t              n;
+  struct part        *part;   /* [parts], spilling */
+  unsigned            parts;
+  struct kq          *q;      /* queue codes here instead, threaded */
+};
+
+static void kcnt_init(struct kcnt *c, const struct buf *seq, unsigned len,
+                      unsigned shards, int canon)
+{
+  /* canonical keys: a pair per code, bar the palindromes of even len */
+  const unsigned long long keys = !canon ? dna_combo(len)
+    : dna_combo(len) / 2 + (len % 2 ? 0 : dna_combo(len / 2) / 2);
+  c->len = len;
+  c->canon = canon;
+  c->mask = dna_mask(len);
+  c->dense = NULL;
+  c->t = NULL;
+  c->key = c->cnt = NULL;
+  c->n = 0;
+  c->part = NULL;
+  c->parts = 0;
+  c->q = NULL;
+  if (dna_combo(len) <= DENSE_MAX &&
+      !(c->dense = calloc((size_t)dna_combo(len), sizeof *c->dense)))
+    perror("calloc"), exit(1);
+  c->far = !c->dense || len > NEAR_LEN;
+  c->shards = c->far ? shards : 1;
+  if (!c->dense) {
+    void *t;
+    if (posix_memalign(&t, KT_LINE, c->shards * sizeof *c->t))
+      perror("posix_memalign"), exit(1);
+    c->t = t;
+    /* hashing spreads keys only roughly evenly; leave some slack */
+    const unsigned long long per = MIN(keys, kmer_total(seq, len)) /
+                                   c->shards;
+    for (unsigned i = 0; i < c->shards; i++)
+      ktinit(&c->t[i].t, c->shards > 1 ? per + per / 16 + 64 : per);
+  }
+}
+
+static void kcnt_free(struct kcnt *c)
+{
+  free(c->dense);
+  if (c->t)
+    for (unsigned i = 0; i < c->shards; i++)
+      ktfree(&c->t[i].t);
+  free(c->t);
+}
+
+/* which shard owns key: a slice of the dense range, or a hash of it
+ * independent of the one kt buckets by */
+static inline unsigned kcnt_shard(const struct kcnt *c, unsigned long long key)
+{
+  if (c->dense)
+    return (unsigned)((key * c->shards) >> (2 * c->len));
+  return (unsigned)((((key * 0xD6E8FEB86659FD93ULL) >> 32) * c->shards) >> 32);
+}
+
+static inline void kcnt_incr(struct kcnt *c, unsigned long long key)
+{
+  if (c->q)
+    c->q->raw[c->q->n++] = key;
+  else if (c->dense)
+    c->dense[key]++;
+  else if (c->part)
+    part_put(c->part + part_of(key, 0, c->parts), key);
+  else
+    ktincr(&c->t[kcnt_shard(c, key)].t, key);
+}
+
+static inline void kcnt_prefetch(const struct kcnt *c, unsigned long long key)
+{
+  if (c->dense)
+    __builtin_prefetch(c->dense + key, 1);
+  else
+    ktprefetch(&c->t[kcnt_shard(c, key)].t, key);
+}
+
+static unsigned long kcnt_get(const struct kcnt *c, unsigned long long key)
+{
+  if (c->key) {
+    size_t lo = 0, hi = c->n;
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (c->key[mid] < key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo < c->n && c->key[lo] == key ? (unsigned long)c->cnt[lo] : 0;
+  }
+  if (c->dense)
+    return c->dense[key];
+  const struct ktentry *e = ktfind(&c->t[kcnt_shard(c, key)].t, key);
+  return e ? e->cnt : 0;
+}
+
+/* allocate a vector of every key seen and its count, length in *n */
+static struct ktentry * kcnt2vec(const struct kcnt *c, ptrdiff_t *n)
+{
+  struct ktentry *v;
+  *n = 0;
+  if (c->key) {
+    v = malloc((c->n ? c->n : 1) * sizeof *v);
+    for (*n = 0; *n < (ptrdiff_t)c->n; (*n)++)
+      v[*n].key = c->key[*n], v[*n].cnt = (unsigned long)c->cnt[*n];
+    return v;
+  }
+  if (!c->dense) {
+    for (unsigned i = 0; i < c->shards; i++)
+      *n += ktsize(&c->t[i].t);
+    struct ktentry *w = v = malloc((*n ? *n : 1) * sizeof *v);
+    for (unsigned i = 0; i < c->shards; i++)
+      w = ktcopy(&c->t[i].t, w);
+    return v;
+  }
+  v = malloc((size_t)dna_combo(c->len) * sizeof *v);
+  for (unsigned long long key = 0; key < dna_combo(c->len); key++)
+    if (c->dense[key])
+      v[*n].key = key, v[(*n)++].cnt = c->dense[key];
+  return v;
+}
+
+/*
+ * roll one code for the longest len along seq: shift in each new
+ * nucleotide and mask off the one that fell out of the window. every
+ * shorter len-mer ending at the same position is the low bits of that
+ * code, so all n counts update from a single pass over seq.
+ *
+ * for canonical counts a second code rolls the other way: each new
+ * nucleotide's complement enters at the top, so the reverse complement
+ * of every shorter len-mer is the high bits of it.
+ *
+ * the roll starts at start, a run of seq free of gaps up to to; only
+ * len-mers wholly in the run and ending in [from, to) are counted
+ */
+static void freq_run(struct kcnt *c, int n, const struct buf *seq,
+                     unsigned maxlen, int canon, size_t start, size_t from,
+                     size_t to)
+{
+  const unsigned long long mask = dna_mask(maxlen);
+  const unsigned top = 2 * maxlen - 2;
+  const size_t warm = MIN(to, MAX(start + maxlen - 1, from));
+  unsigned long long key = 0, rc = 0;
+  size_t i = start;
+#define code(c, key, rc) ((c)->canon ? \
+  MIN((key) & (c)->mask, (rc) >> (2 * (maxlen - (c)->len))) : (key) & (c)->mask)
+#define roll(key, rc, nuc) do { \
+    const unsigned nuc_ = (nuc); \
+    key = ((key << 2) | nuc_) & mask; \
+    if (canon) \
+      rc = (rc >> 2) | (unsigned long long)(3 ^ nuc_) << top; \
+  } while (0)
+  for (; i < warm; i++) {
+    roll(key, rc, buf_nuc(seq, i));
+    for (int j = 0; j < n; j++)
+      if (i >= from && i + 1 - start >= c[j].len)
+        kcnt_incr(c + j, code(c + j, key, rc));
+  }
+  /* large tables miss cache on every update; fetch each line PREFETCH
+   * positions before it is needed */
+  unsigned long long ahead = key, rcahead = rc;
+  for (size_t p = i; p < MIN(to, i + PREFETCH); p++)
+    roll(ahead, rcahead, buf_nuc(seq, p));
+  for (; i < to; i++) {
+    roll(key, rc, buf_nuc(seq, i));
+    if (i + PREFETCH < to) {
+      roll(ahead, rcahead, buf_nuc(seq, i + PREFETCH));
+      for (int j = 0; j < n; j++) {
+        const unsigned long long k = code(c + j, ahead, rcahead);
+        if (c[j].far && !c[j].q)
+          kcnt_prefetch(c + j, k);
+      }
+    }
+    for (int j = 0; j < n; j++)
+      kcnt_incr(c + j, code(c + j, key, rc));
+  }
+#undef roll
+#undef code
+}
+
+/* count the len-mers ending in [from, to), rolling afresh after each gap
+ * and from the maxlen - 1 nucleotides before from */
+static void freq_walk(struct kcnt *c, int n, const struct buf *seq,
+                      size_t from, size_t to)
+{
+  unsigned maxlen = 0;
+  int canon = 0;
+  for (int j = 0; j < n; j++)
+    maxlen = MAX(maxlen, c[j].len), canon |= c[j].canon;
+  size_t start = from > maxlen - 1 ? from - (maxlen - 1) : 0;
+  for (size_t g = buf_gap(seq, start); start < to; g++) {
+    const size_t end = g < seq->ngap ? MIN(to, seq->gap[g]) : to;
+    freq_run(c, n, seq, maxlen, canon, start, MAX(start, from), end);
+    start = end + 1;
+  }
+}
+
+/* group q's batch by the thread owning each code's shard of c */
+static void kq_sort(const struct kcnt *c, struct kq *q, unsigned nth)
+{
+  memset(q->off, 0, (nth + 1) * sizeof *q->off);
+  for (size_t i = 0; i < q->n; i++)
+    q->off[kcnt_shard(c, q->raw[i]) % nth + 1]++;
+  for (unsigned t = 0; t < nth; t++)
+    q->off[t + 1] += q->off[t];
+  for (size_t i = 0; i < q->n; i++)
+    q->key[q->off[kcnt_shard(c, q->raw[i]) % nth]++] = q->raw[i];
+  /* each slot now ends where the next began */
+  memmove(q->off + 1, q->off, nth * sizeof *q->off);
+  q->off[0] = 0;
+}
+
+/* count the codes every thread queued for self's shards of c */
+static void kq_drain(struct kcnt *c, const struct kq *q, unsigned nth,
+                     unsigned self)
+{
+  for (unsigned t = 0; t < nth; t++) {
+    const uint64_t *key = q[t].key + q[t].off[self];
+    const size_t n = q[t].off[self + 1] - q[t].off[self];
+    for (size_t i = 0; i < n; i++) {
+      if (i + PREFETCH < n)
+        kcnt_prefetch(c, key[i + PREFETCH]);
+      kcnt_incr(c, key[i]);
+    }
+  }
+}
 
-static unsigned long freq_build(struct ht *t, const struct buf *seq, unsigned len) {
-  const unsigned long total = seq->len - len + 1;
-  const char *key = seq->str;
-  for (unsigned long i = 0; i < total; i++)
-    htincr(t, key, len, index(key, len)), key++;
-  return total;
+/*
+ * each thread walks its own slice of seq, a KQ_BATCH of positions at a
+ * time. near counts go to private copies, summed at the end; far codes
+ * are queued, grouped by owner, and after a barrier each thread counts
+ * those for its own shards from every thread's queue
+ */
+static void freq_build(struct kcnt *c, int n, const struct buf *seq)
+{
+  int far = 0;
+  for (int j = 0; j < n; j++)
+    far |= c[j].far;
+  struct kq *qs = NULL;
+  #pragma omp parallel
+  {
+    const unsigned self = omp_get_thread_num(),
+                   nth = omp_get_num_threads();
+    if (nth == 1) {
+      freq_walk(c, n, seq, 0, seq->len);
+    } else {
+      const size_t per = (seq->len + nth - 1) / nth,
+                   lo = MIN(seq->len, per * self),
+                   hi = MIN(seq->len, lo + per);
+      struct kcnt *mine = malloc(n * sizeof *mine);
+      if (!mine)
+        perror("malloc"), exit(1);
+      #pragma omp single
+      if (far && !(qs = malloc(nth * n * sizeof *qs)))
+        perror("malloc"), exit(1);
+      for (int j = 0; j < n; j++) {
+        mine[j] = c[j];
+        if (!c[j].far) {
+          mine[j].dense = calloc((size_t)dna_combo(c[j].len),
+                                 sizeof *mine[j].dense);
+          if (!mine[j].dense)
+            perror("calloc"), exit(1);
+          continue;
+        }
+        struct kq *q = mine[j].q = qs + j * nth + self;
+        q->raw = malloc(KQ_BATCH * sizeof *q->raw);
+        q->key = malloc(KQ_BATCH * sizeof *q->key);
+        q->off = malloc((nth + 1) * sizeof *q->off);
+        if (!q->raw || !q->key || !q->off)
+          perror("malloc"), exit(1);
+        q->n = 0;
+      }
+      /* every thread runs as many rounds, to meet at each barrier */
+      for (size_t at = 0; at < per; at += KQ_BATCH) {
+        freq_walk(mine, n, seq, MIN(hi, lo + at),
+                  MIN(hi, lo + at + KQ_BATCH));
+        if (!far)
+          continue;
+        for (int j = 0; j < n; j++)
+          if (c[j].far)
+            kq_sort(c + j, mine[j].q, nth);
+        #pragma omp barrier
+        for (int j = 0; j < n; j++)
+          if (c[j].far)
+            kq_drain(c + j, qs + j * nth, nth, self);
+        #pragma omp barrier
+        for (int j = 0; j < n; j++)
+          if (c[j].far)
+            mine[j].q->n = 0;
+      }
+      for (int j = 0; j < n; j++) {
+        if (c[j].far) {
+          free(mine[j].q->raw);
+          free(mine[j].q->key);
+          free(mine[j].q->off);
+          continue;
+        }
+        #pragma omp critical
+        for (unsigned long long key = 0; key < dna_combo(c[j].len); key++)
+          c[j].dense[key] += mine[j].dense[key];
+        free(mine[j].dense);
+      }
+      free(mine);
+    }
+  }
+  free(qs);
 }
 
 /*
@@ -75,118 +632,1014 @@ static unsigned long freq_build(struct ht *t, const struct buf *seq, unsigned le
  */
 static int freq_cmp(const void *va, const void *vb)
 {
-  const struct htentry *a = va, *b = vb;
-  if (a->val.cnt != b->val.cnt)
-    return (int)(b->val.cnt - a->val.cnt);
-  return strcmp(b->key, a->key);
+  const struct ktentry *a = va, *b = vb;
+  if (a->cnt != b->cnt)
+    return (a->cnt < b->cnt) - (a->cnt > b->cnt);
+  return (a->key < b->key) - (a->key > b->key);
 }
 
-static void freq_print(const struct htentry *e, unsigned cnt,
-                       unsigned long total, char *dst)
+static void freq_print(const struct ktentry *e, ptrdiff_t cnt, unsigned len,
+                       unsigned long long total, FILE *out)
 {
+  char key[33];
   while (cnt--)
-    dst += sprintf(dst, "%.*s %5.3f\n",
-      (unsigned)e->len, e->key, 100. * e->val.cnt / total), e++;
-  strcat(dst, "\n");
+    fprintf(out, "%s %5.3f\n",
+      dna_str(e->key, len, key), 100. * e->cnt / total), e++;
+  fputc('\n', out);
 }
 
-/* count all the 1-nucleotide and 2-nucleotide sequences, and write the
- * code and percentage frequency, sorted */
-static void do_freq(const struct buf *seq, unsigned len, char *dst)
+/*
+ * the first top entries in freq_cmp order, kept as a heap with the one
+ * that sorts last at the root: most entries lose to the root on count
+ * alone and cost one compare
+ */
+struct top {
+  struct ktentry *h;
+  ptrdiff_t       n,
+                  max;
+};
+
+static void top_push(struct top *t, unsigned long long key, unsigned long cnt)
 {
-  struct ht t;
-  htinit(&t, HT_BINS, MIN(dna_combo(len), MAX_ENTRIES));
-  unsigned long total = freq_build(&t, seq, len);
-  {
-    struct htentry *e = ht2vec(&t);
-    qsort(e, htsize(&t), sizeof *e, freq_cmp);
-    freq_print(e, htsize(&t), total, dst);
+  struct ktentry *h = t->h, e = { key, cnt };
+  ptrdiff_t i;
+  if (t->n == t->max) {
+    if (cnt < h[0].cnt || freq_cmp(&e, h) >= 0)
+      return;
+    /* sift the hole left by the root down to where e belongs */
+    for (i = 0; 2 * i + 1 < t->n; ) {
+      ptrdiff_t k = 2 * i + 1;
+      if (k + 1 < t->n && freq_cmp(h + k + 1, h + k) > 0)
+        k++;
+      if (freq_cmp(h + k, &e) <= 0)
+        break;
+      h[i] = h[k], i = k;
+    }
+  } else {
+    for (i = t->n++; i && freq_cmp(h + (i - 1) / 2, &e) < 0; i = (i - 1) / 2)
+      h[i] = h[(i - 1) / 2];
+  }
+  h[i] = e;
+}
+
+/* distinct keys c holds */
+static ptrdiff_t kcnt_size(const struct kcnt *c)
+{
+  ptrdiff_t n = 0;
+  if (c->key)
+    return (ptrdiff_t)c->n;
+  if (c->dense) {
+    for (unsigned long long key = 0; key < dna_combo(c->len); key++)
+      n += !!c->dense[key];
+    return n;
+  }
+  for (unsigned s = 0; s < c->shards; s++)
+    n += ktsize(&c->t[s].t);
+  return n;
+}
+
+/* the top len-mers of c and their counts, sorted; length in *n, and the
+ * sum of every count in *total. walks only what c holds, never a vector
+ * of all of it */
+static struct ktentry * kcnt_top(const struct kcnt *c, ptrdiff_t top,
+                                 ptrdiff_t *n, unsigned long long *total)
+{
+  /* no bigger than c, however many were asked for */
+  top = MIN(top, kcnt_size(c));
+  struct top t = { malloc((top ? top : 1) * sizeof *t.h), 0, top };
+  if (!t.h)
+    perror("malloc"), exit(1);
+  *total = 0;
+  if (c->key) {
+    for (size_t i = 0; i < c->n; i++)
+      top_push(&t, c->key[i], (unsigned long)c->cnt[i]), *total += c->cnt[i];
+  } else if (c->dense) {
+    for (unsigned long long key = 0; key < dna_combo(c->len); key++)
+      if (c->dense[key])
+        top_push(&t, key, c->dense[key]), *total += c->dense[key];
+  } else {
+    for (unsigned s = 0; s < c->shards; s++) {
+      const struct kt *kt = &c->t[s].t;
+      for (unsigned long idx = 0; idx < kt->bktcnt; idx++)
+        for (unsigned i = 0; i < KT_BUCKET; i++)
+          if (kt->bkt[idx].e[i].cnt) {
+            top_push(&t, kt->bkt[idx].e[i].key, kt->bkt[idx].e[i].cnt);
+            *total += kt->bkt[idx].e[i].cnt;
+          }
+    }
+  }
+  qsort(t.h, t.n, sizeof *t.h, freq_cmp);
+  *n = t.n;
+  return t.h;
+}
+
+/* every len-mer seen and its count, sorted, or only the first top if
+ * top > 0; length in *n. *total counts the len-mers seen, those spanning
+ * a gap left out */
+static struct ktentry * do_freq(const struct kcnt *c, ptrdiff_t top,
+                                ptrdiff_t *n, unsigned long long *total)
+{
+  if (top > 0)
+    return kcnt_top(c, top, n, total);
+  struct ktentry *e = kcnt2vec(c, n);
+  *total = 0;
+  for (ptrdiff_t i = 0; i < *n; i++)
+    *total += e[i].cnt;
+  qsort(e, *n, sizeof *e, freq_cmp);
+  return e;
+}
+
+/*
+ * counting api: a kset counts every len asked for over seq in a single
+ * freq_build pass, one table per distinct len no matter how many queries
+ * share it; any number of lookups are then answered from the tables.
+ * kset_save writes the tables out as an index, and kset_load maps one
+ * back in place of counting
+ */
+struct kset {
+  size_t              len;    /* of the sequence counted */
+  unsigned long long  sum;    /* buf_sum of it */
+  int                 canon;  /* every table canonical */
+  struct kcnt        *c;
+  int                 n;
+  void               *map;    /* index mapping, if loaded */
+  size_t              maplen;
+};
+
+static const struct kcnt * kset_get(const struct kset *s, unsigned len)
+{
+  for (int i = 0; i < s->n; i++)
+    if (s->c[i].len == len)
+      return s->c + i;
+  return NULL;
+}
+
+/* count lens[0..n-1], 1 <= len <= 32, duplicates allowed; canonically
+ * if canon */
+static void kset_count(struct kset *s, const struct buf *seq,
+                       const unsigned *lens, int n, int canon)
+{
+  s->len = seq->len;
+  s->sum = buf_sum(seq);
+  s->canon = canon;
+  s->map = NULL;
+  s->c = malloc((n ? n : 1) * sizeof *s->c);
+  s->n = 0;
+  if (!s->c)
+    perror("malloc"), exit(1);
+  for (int i = 0; i < n; i++)
+    if (!kset_get(s, lens[i]))
+      kcnt_init(s->c + s->n++, seq, lens[i], omp_get_max_threads(), canon);
+  if (s->n)
+    freq_build(s->c, s->n, seq);
+}
+
+/* occurrences of the len-mer at dna, on either strand if canonical; 0 if
+ * len was not counted */
+static unsigned long kset_query(const struct kset *s, const char *dna,
+                                unsigned len)
+{
+  const struct kcnt *c = kset_get(s, len);
+  unsigned long long key = dna_hash(dna, len);
+  if (c && c->canon)
+    key = MIN(key, dna_rc(key, len));
+  return c ? kcnt_get(c, key) : 0;
+}
+
+static void kset_free(struct kset *s)
+{
+  for (int i = 0; i < s->n; i++)
+    kcnt_free(s->c + i);
+  free(s->c);
+  if (s->map)
+    munmap(s->map, s->maplen);
+}
+
+/*
+ * index file, native byte order, every field 8-byte aligned:
+ *
+ *   struct kidx          header
+ *   struct kidx_tab      [ntab]
+ *   keys[n], cnts[n]     uint64 per table at off, keys ascending
+ */
+static const char KidxMagic[8] = "kn-idx1";
+
+enum { KIDX_CANON = 1 };
+
+struct kidx {
+  char     magic[8];
+  uint64_t len,
+           sum;
+  uint32_t ntab,
+           flags;
+};
+
+struct kidx_tab {
+  uint32_t k,
+           pad;
+  uint64_t n,
+           off;
+};
+
+/* lsd radix sort of e[0..n-1] by key, keys under 2 * len bits: a few
+ * linear passes where qsort of tens of millions of entries takes seconds */
+static void key_sort(struct ktentry *e, ptrdiff_t n, unsigned len)
+{
+  enum { DIGIT = 11 };
+  struct ktentry *tmp = malloc((n ? n : 1) * sizeof *tmp), *src = e, *dst = tmp;
+  static ptrdiff_t at[1 << DIGIT];
+  if (!tmp)
+    perror("malloc"), exit(1);
+  for (unsigned shift = 0; shift < 2 * len; shift += DIGIT) {
+    memset(at, 0, sizeof at);
+    for (ptrdiff_t i = 0; i < n; i++)
+      at[(src[i].key >> shift) & ((1 << DIGIT) - 1)]++;
+    ptrdiff_t sum = 0;
+    for (int d = 0; d < 1 << DIGIT; d++) {
+      const ptrdiff_t c = at[d];
+      at[d] = sum, sum += c;
+    }
+    for (ptrdiff_t i = 0; i < n; i++)
+      dst[at[(src[i].key >> shift) & ((1 << DIGIT) - 1)]++] = src[i];
+    struct ktentry *t = src;
+    src = dst, dst = t;
+  }
+  if (src != e)
+    memcpy(e, src, n * sizeof *e);
+  free(tmp);
+}
+
+/* an index being written: tables are sized as they are written, so
+ * their headers go in last */
+struct kidx_out {
+  FILE            *f;
+  const char      *path;
+  struct kidx_tab *tab;
+  int              n;     /* tables begun */
+  uint64_t         off;   /* where the next one goes */
+};
+
+static void kidx_open(struct kidx_out *o, const char *path, int ntab)
+{
+  o->f = fopen(path, "wb");
+  o->path = path;
+  o->tab = calloc(ntab ? ntab : 1, sizeof *o->tab);
+  o->n = 0;
+  o->off = sizeof(struct kidx) + ntab * sizeof *o->tab;
+  if (!o->f || !o->tab)
+    perror(path), exit(1);
+}
+
+/* write n words at byte offset at */
+static void kidx_put(struct kidx_out *o, uint64_t at, const uint64_t *w,
+                     size_t n)
+{
+  if (fseeko(o->f, (off_t)at, SEEK_SET) || fwrite(w, sizeof *w, n, o->f) != n)
+    perror(o->path), exit(1);
+}
+
+/* begin table k of n entries: keys at off, counts right after */
+static const struct kidx_tab * kidx_table(struct kidx_out *o, unsigned k,
+                                          uint64_t n)
+{
+  struct kidx_tab *t = o->tab + o->n++;
+  t->k = k;
+  t->n = n;
+  t->off = o->off;
+  o->off += 2 * n * sizeof(uint64_t);
+  return t;
+}
+
+/* table k from e[0..n-1], in key order */
+static void kidx_vec(struct kidx_out *o, unsigned k, const struct ktentry *e,
+                     ptrdiff_t n)
+{
+  const struct kidx_tab *t = kidx_table(o, k, n);
+  uint64_t *w = malloc((n ? n : 1) * sizeof *w);
+  if (!w)
+    perror("malloc"), exit(1);
+  for (ptrdiff_t j = 0; j < n; j++)
+    w[j] = e[j].key;
+  kidx_put(o, t->off, w, n);
+  for (ptrdiff_t j = 0; j < n; j++)
+    w[j] = e[j].cnt;
+  kidx_put(o, t->off + n * sizeof *w, w, n);
+  free(w);
+}
+
+/* m more entries of table t, after the done already written */
+static void kidx_emit(struct kidx_out *o, const struct kidx_tab *t,
+                      uint64_t *done, const uint64_t *key,
+                      const uint64_t *cnt, size_t m)
+{
+  kidx_put(o, t->off + *done * sizeof *key, key, m);
+  kidx_put(o, t->off + (t->n + *done) * sizeof *cnt, cnt, m);
+  *done += m;
+}
+
+#define KIDX_OUT (1 << 16) /* entries buffered on the way to an index */
+
+/* dense table c, straight from its array, which is in key order */
+static void kidx_dense(struct kidx_out *o, const struct kcnt *c)
+{
+  uint64_t n = 0, done = 0;
+  for (unsigned long long key = 0; key < dna_combo(c->len); key++)
+    n += !!c->dense[key];
+  const struct kidx_tab *t = kidx_table(o, c->len, n);
+  uint64_t *key = malloc(KIDX_OUT * sizeof *key),
+           *cnt = malloc(KIDX_OUT * sizeof *cnt);
+  size_t m = 0;
+  if (!key || !cnt)
+    perror("malloc"), exit(1);
+  for (unsigned long long k = 0; k < dna_combo(c->len); k++) {
+    if (!c->dense[k])
+      continue;
+    key[m] = k, cnt[m++] = c->dense[k];
+    if (m == KIDX_OUT)
+      kidx_emit(o, t, &done, key, cnt, m), m = 0;
+  }
+  kidx_emit(o, t, &done, key, cnt, m);
+  free(key);
+  free(cnt);
+}
+
+static void kidx_close(struct kidx_out *o, size_t len, unsigned long long sum,
+                       int canon)
+{
+  struct kidx h = { { 0 }, len, sum, (uint32_t)o->n, canon ? KIDX_CANON : 0 };
+  memcpy(h.magic, KidxMagic, sizeof h.magic);
+  rewind(o->f);
+  fwrite(&h, sizeof h, 1, o->f);
+  fwrite(o->tab, sizeof *o->tab, o->n, o->f);
+  if (ferror(o->f) | fclose(o->f))
+    perror(o->path), exit(1);
+  free(o->tab);
+}
+
+static void kset_save(const struct kset *s, const char *path)
+{
+  struct kidx_out o;
+  kidx_open(&o, path, s->n);
+  for (int i = 0; i < s->n; i++) {
+    ptrdiff_t n;
+    if (s->c[i].dense) {
+      kidx_dense(&o, s->c + i);
+      continue;
+    }
+    struct ktentry *e = kcnt2vec(s->c + i, &n);
+    key_sort(e, n, s->c[i].len);
+    kidx_vec(&o, s->c[i].len, e, n);
     free(e);
   }
-  htfree(&t);
-}
-
-static void frq(const struct buf *seq, char *dst)
-{
-  char buf[2][512];
-  #pragma omp parallel for
-  for (int i = 0; i < 2; i++)
-    do_freq(seq, i+1, buf[i]);
-  for (int i = 0; i < 2; i++)
-    strcat(dst, buf[i]);
-}
-
-/* count all 'buf' substrings of length 'len', return count for buf[0..len-1] */
-static void do_cnt(const struct buf *seq, unsigned len, char *buf)
-{
-  const char *Match = "GGTATTTTAATTTATAGT";
-  unsigned long cnt = 0;
-  struct ht t;
-  htinit(&t, HT_BINS, MIN(dna_combo(len), MAX_ENTRIES));
-  freq_build(&t, seq, len);
-  struct htentry *e = htfind(&t, Match, len, index(Match, len));
-  if (e)
-    cnt = e->val.cnt;
-  htfree(&t);
-  sprintf(buf, "%lu\t%.*s\n", cnt, len, Match);
-}
-
-/* COUNT ALL THE 3- 4- 6- 12- AND 18-NUCLEOTIDE SEQUENCES, and write the
- * count and code for the specific sequences GGT GGTA GGTATT GGTATTTTAATT
- * GGTATTTTAATTTATAGT */
-#define CNT (int)(sizeof Cnt / sizeof Cnt[0])
-static void cnt(const struct buf *seq, char *out) {
-  static struct {
-    unsigned len;
-    char res[64];
-  } Cnt[] = {
-    {  3, "" },
-    {  4, "" },
-    {  6, "" },
-    { 12, "" },
-    { 18, "" },
-  };
-  #pragma omp parallel for schedule(static,1)
-  for (int i = CNT - 1; i >= 0; i--)
-    if (seq->len >= Cnt[i].len)
-      do_cnt(seq, Cnt[i].len, Cnt[i].res);
-  for (int i = 0; i < CNT; i++)
-    strcat(out, Cnt[i].res);
+  kidx_close(&o, s->len, s->sum, s->canon);
 }
 
-/* read line-by-line a redirected FASTA format file from stdin
- * extract DNA sequence THREE */
-static size_t dna_seq3(struct buf *b)
+/* map the index at path; its tables are queried where they lie */
+static void kset_load(struct kset *s, const char *path)
 {
-  buf_init(b);
-  while (NULL != fgets(b->str, BUFSZ, stdin))
-    if ('>' == *b->str && !strncmp(">THREE", b->str, 6))
-      break;
-  char *curr = b->str;
-  while (NULL != fgets(curr, BUFSZ, stdin)) {
-    if ('>' == *curr)
-      break;
-    size_t len = strlen(curr);
-    if ('\n' == curr[len-1])
-      len--;
-    buf_grow(b, len);
-    curr = b->str + b->len;
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st))
+    perror(path), exit(1);
+  s->maplen = st.st_size;
+  const struct kidx *h = NULL;
+  if (s->maplen >= sizeof *h) {
+    s->map = mmap(NULL, s->maplen, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == s->map)
+      perror("mmap"), exit(1);
+    h = s->map;
+  }
+  close(fd);
+  if (!h || memcmp(h->magic, KidxMagic, sizeof h->magic) ||
+      (s->maplen - sizeof *h) / sizeof(struct kidx_tab) < h->ntab)
+    fprintf(stderr, "kn: %s: not an index\n", path), exit(1);
+  const struct kidx_tab *tab = (const struct kidx_tab *)(h + 1);
+  s->len = h->len;
+  s->sum = h->sum;
+  s->canon = !!(h->flags & KIDX_CANON);
+  s->n = (int)h->ntab;
+  s->c = malloc((s->n ? s->n : 1) * sizeof *s->c);
+  if (!s->c)
+    perror("malloc"), exit(1);
+  for (int i = 0; i < s->n; i++) {
+    struct kcnt *c = s->c + i;
+    if (tab[i].k < 1 || tab[i].k > 32 || tab[i].off % 8 ||
+        tab[i].off > s->maplen || (s->maplen - tab[i].off) / 16 < tab[i].n)
+      fprintf(stderr, "kn: %s: bad table %d\n", path, i), exit(1);
+    memset(c, 0, sizeof *c);
+    c->len = tab[i].k;
+    c->canon = s->canon;
+    c->mask = dna_mask(c->len);
+    c->n = tab[i].n;
+    c->key = (const uint64_t *)((const char *)s->map + tab[i].off);
+    c->cnt = c->key + c->n;
+  }
+}
+
+/* write the code and percentage frequency of every len-mer, or the top
+ * most frequent, for each of lens, sorted; the sorts run side by side */
+static void frq(const struct kset *s, const unsigned *lens, int n,
+                ptrdiff_t top, FILE *out)
+{
+  struct ktentry **e = malloc((n ? n : 1) * sizeof *e);
+  ptrdiff_t *cnt = malloc((n ? n : 1) * sizeof *cnt);
+  unsigned long long *total = malloc((n ? n : 1) * sizeof *total);
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < n; i++)
+    e[i] = do_freq(kset_get(s, lens[i]), top, cnt + i, total + i);
+  for (int i = 0; i < n; i++) {
+    freq_print(e[i], cnt[i], lens[i], total[i], out);
+    free(e[i]);
+  }
+  free(total);
+  free(cnt);
+  free(e);
+}
+
+/* write the count and code of each query no longer than seq */
+static void cnt(const struct kset *s, char **q, int n, FILE *out)
+{
+  for (int i = 0; i < n; i++) {
+    const unsigned len = (unsigned)strlen(q[i]);
+    if (s->len >= len)
+      fprintf(out, "%lu\t%s\n", kset_query(s, q[i], len), q[i]);
   }
+}
+
+/*
+ * pick sequence THREE out of FASTA text fed in arbitrary blocks: skip to
+ * the line starting ">THREE", then pack every line up to the next '>'
+ * line, dropping newlines, "\r\n" as well as "\n". with a drain, the
+ * packed sequence is handed over whenever DRAIN_LEN has built up, for the
+ * drain to consume
+ */
+#define DRAIN_LEN (BUFSZ * 4) /* nucleotides */
+
+typedef void drain_fn(struct buf *b, void *arg);
+
+struct fasta {
+  struct buf *b;
+  enum { SEEK, SEQ, DONE } state;
+  unsigned    id;     /* chars of the current line compared against Id */
+  int         match,  /* ...and whether they matched */
+              bol,    /* at beginning of line */
+              cr;     /* a '\r' ended the last block, held back */
+  drain_fn   *drain;
+  void       *arg;
+};
+
+static const char Id[] = ">THREE";
+
+static void fasta_feed(struct fasta *f, const char *p, size_t n)
+{
+  const char *end = p + n, *nl;
+  while (p < end && f->state != DONE) {
+    if (f->state == SEEK) {
+      while (p < end && f->id < sizeof Id - 1 && '\n' != *p)
+        f->match &= *p++ == Id[f->id++];
+      if (!(nl = memchr(p, '\n', end - p)))
+        return; /* rest of the line is in the next block */
+      if (f->match && f->id == sizeof Id - 1)
+        f->state = SEQ, f->bol = 1;
+      f->id = 0, f->match = 1;
+      p = nl + 1;
+    } else if (f->bol && '>' == *p) {
+      f->state = DONE;
+    } else {
+      nl = memchr(p, '\n', end - p);
+      const char *eol = nl ? nl : end;
+      const int cr = eol > p && '\r' == eol[-1];
+      if (f->cr && p != nl)
+        buf_pack(f->b, "\r", 1); /* it did not end a line after all */
+      buf_pack(f->b, p, eol - p - cr);
+      f->cr = cr && !nl;
+      if (f->drain && f->b->len >= DRAIN_LEN)
+        f->drain(f->b, f->arg);
+      f->bol = !!nl;
+      p = nl ? nl + 1 : end;
+    }
+  }
+}
+
+/* read FASTA from path, or stdin if NULL; extract DNA sequence THREE.
+ * a named file is mapped rather than read, and either way the packed
+ * sequence is sized from the file up front; unless there is a drain, when
+ * the file is read and only a block of sequence is held at a time */
+static size_t dna_seq3(struct buf *b, const char *path, drain_fn *drain,
+                       void *arg)
+{
+  struct fasta f = { b, SEEK, 0, 1, 0, 0, drain, arg };
+  struct stat st;
+  int fd = path ? open(path, O_RDONLY) : STDIN_FILENO;
+  if (fd < 0 || fstat(fd, &st))
+    perror(path), exit(1);
+  buf_init(b, !drain && S_ISREG(st.st_mode) ? (size_t)st.st_size
+                                            : DRAIN_LEN + BUFSZ);
+  if (path && st.st_size && !drain) {
+    char *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == m)
+      perror("mmap"), exit(1);
+    posix_madvise(m, st.st_size, POSIX_MADV_SEQUENTIAL);
+    fasta_feed(&f, m, st.st_size);
+    munmap(m, st.st_size);
+  } else {
+    char *blk = malloc(BUFSZ);
+    ssize_t n;
+    while (DONE != f.state && (n = read(fd, blk, BUFSZ)) > 0)
+      fasta_feed(&f, blk, n);
+    free(blk);
+  }
+  if (path)
+    close(fd);
+  if (drain)
+    drain(b, arg);
   return b->len;
 }
 
-int main(void)
+/*
+ * counting in bounded memory. a far table is never held whole: the scan
+ * hashes each len-mer's code to one of parts spill files, and each file
+ * is then counted alone in a kt the budget can hold, split again by a
+ * fresh hash if its keys outgrow it. each count is sorted by key into a
+ * run; a key lands in one partition only, so the runs merge straight into
+ * an index, which is mapped back like any other. dense tables are
+ * counted in place while they fit the budget between them, and spilled
+ * like the rest once they do not; the sequence streams through a block
+ * at a time
+ */
+#define PART_MAX    256 /* spill files open at once */
+#define SPILL_DEPTH 3   /* times a partition may split */
+/* budget per distinct key: the kt at 80% load, its vector, the sort's copy */
+#define SPILL_COST  (4 * sizeof(struct ktentry))
+
+/* sorted counts of one table's partitions, end to end in one file */
+struct runs {
+  FILE     *f;
+  struct {
+    uint64_t off,
+             n;
+  }        *v;
+  int       n,
+            alloc;
+  uint64_t  end;
+};
+
+static void run_add(struct runs *r, const struct ktentry *e, ptrdiff_t n)
+{
+  if (r->n == r->alloc) {
+    r->alloc = MAX(16, r->alloc * 2);
+    r->v = realloc(r->v, r->alloc * sizeof *r->v);
+    if (!r->v)
+      perror("realloc"), exit(1);
+  }
+  r->v[r->n].off = r->end;
+  r->v[r->n++].n = n;
+  if (fwrite(e, sizeof *e, n, r->f) != (size_t)n)
+    perror("spill"), exit(1);
+  r->end += n * sizeof *e;
+}
+
+/* count the codes spilled to p into runs */
+static void part_count(struct part *p, unsigned len, unsigned long long budget,
+                       unsigned depth, struct runs *r)
+{
+  const unsigned long long cap = MAX(budget / SPILL_COST, 1);
+  uint64_t rec[PART_REC];
+  size_t got;
+  int over = 0;
+  struct kt t;
+  part_flush(p);
+  rewind(p->f);
+  ktinit(&t, MIN(p->n, cap));
+  while (!over && (got = fread(rec, sizeof *rec, PART_REC, p->f)) > 0)
+    for (size_t i = 0; i < got; i++) {
+      if (ktsize(&t) >= (ptrdiff_t)cap && depth < SPILL_DEPTH &&
+          !ktfind(&t, rec[i])) {
+        over = 1;
+        break;
+      }
+      ktincr(&t, rec[i]);
+    }
+  if (ferror(p->f))
+    perror("spill"), exit(1);
+  if (over) {
+    /* more keys than fit: hash them apart again and count each share */
+    const unsigned parts = (unsigned)MIN(PART_MAX, p->n / cap + 1);
+    struct part *sub = calloc(parts, sizeof *sub);
+    ktfree(&t);
+    if (!sub)
+      perror("calloc"), exit(1);
+    for (unsigned i = 0; i < parts; i++)
+      sub[i].f = spill_file();
+    rewind(p->f);
+    while ((got = fread(rec, sizeof *rec, PART_REC, p->f)) > 0)
+      for (size_t i = 0; i < got; i++)
+        part_put(sub + part_of(rec[i], depth + 1, parts), rec[i]);
+    fclose(p->f);
+    for (unsigned i = 0; i < parts; i++)
+      part_count(sub + i, len, budget, depth + 1, r);
+    free(sub);
+    return;
+  }
+  fclose(p->f);
+  const ptrdiff_t n = ktsize(&t);
+  struct ktentry *e = kt2vec(&t);
+  ktfree(&t);
+  if (n) {
+    key_sort(e, n, len);
+    run_add(r, e, n);
+  }
+  free(e);
+}
+
+/* a run being merged: a window of it in memory */
+struct cur {
+  struct ktentry *e;
+  size_t          at,
+                  got;
+  uint64_t        off,
+                  left;
+};
+
+/* refill c's window once it is used up; 0 once the run is */
+static int cur_fill(struct cur *c, FILE *f, size_t max)
+{
+  if (c->at < c->got)
+    return 1;
+  if (!c->left)
+    return 0;
+  c->got = (size_t)MIN(max, c->left);
+  if (fseeko(f, (off_t)c->off, SEEK_SET) ||
+      fread(c->e, sizeof *c->e, c->got, f) != c->got)
+    perror("spill"), exit(1);
+  c->off += c->got * sizeof *c->e;
+  c->left -= c->got;
+  c->at = 0;
+  return 1;
+}
+
+/* heap of runs by their next key, least at the root */
+#define cur_key(cs, i) ((cs)[i].e[(cs)[i].at].key)
+
+static void cur_sift(const struct cur *cs, int *h, int n, int i)
+{
+  for (;;) {
+    int k = 2 * i + 1;
+    if (k >= n)
+      return;
+    if (k + 1 < n && cur_key(cs, h[k + 1]) < cur_key(cs, h[k]))
+      k++;
+    if (cur_key(cs, h[i]) <= cur_key(cs, h[k]))
+      return;
+    const int t = h[i];
+    h[i] = h[k], h[k] = t, i = k;
+  }
+}
+
+/* table k from the runs in r, merged in key order a window apiece */
+static void kidx_merge(struct kidx_out *o, unsigned k, struct runs *r,
+                       unsigned long long budget)
+{
+  uint64_t n = 0, done = 0;
+  for (int i = 0; i < r->n; i++)
+    n += r->v[i].n;
+  const struct kidx_tab *t = kidx_table(o, k, n);
+  const size_t win = (size_t)MAX(64, MIN(KIDX_OUT, budget / 2 /
+                                 sizeof(struct ktentry) / (r->n ? r->n : 1)));
+  struct cur *cs = calloc(r->n ? r->n : 1, sizeof *cs);
+  int *h = malloc((r->n ? r->n : 1) * sizeof *h), hn = 0;
+  uint64_t *key = malloc(KIDX_OUT * sizeof *key),
+           *cnt = malloc(KIDX_OUT * sizeof *cnt);
+  size_t m = 0;
+  if (!cs || !h || !key || !cnt || fflush(r->f))
+    perror("merge"), exit(1);
+  for (int i = 0; i < r->n; i++) {
+    cs[i].e = malloc(win * sizeof *cs[i].e);
+    if (!cs[i].e)
+      perror("malloc"), exit(1);
+    cs[i].off = r->v[i].off;
+    cs[i].left = r->v[i].n;
+    if (cur_fill(cs + i, r->f, win))
+      h[hn++] = i;
+  }
+  for (int i = hn / 2 - 1; i >= 0; i--)
+    cur_sift(cs, h, hn, i);
+  while (hn) {
+    struct cur *c = cs + h[0];
+    key[m] = c->e[c->at].key;
+    cnt[m++] = c->e[c->at++].cnt;
+    if (!cur_fill(c, r->f, win))
+      h[0] = h[--hn];
+    cur_sift(cs, h, hn, 0);
+    if (m == KIDX_OUT || !hn)
+      kidx_emit(o, t, &done, key, cnt, m), m = 0;
+  }
+  for (int i = 0; i < r->n; i++)
+    free(cs[i].e);
+  free(cs);
+  free(h);
+  free(key);
+  free(cnt);
+}
+
+/* the scan: each block of sequence walked into the tables, then dropped
+ * but for the len-mer tail the next block rolls on from */
+struct spill {
+  struct kcnt        *c;
+  int                 n;
+  unsigned            keep;  /* nucleotides carried between blocks */
+  size_t              from,  /* first not yet walked */
+                      len,   /* dropped so far */
+                      ngap;  /* ...and gaps in it */
+  unsigned long long  sum,   /* of the bytes dropped */
+                      gsum;  /* ...and of their gaps */
+};
+
+static void spill_drain(struct buf *b, void *arg)
+{
+  struct spill *sp = arg;
+  freq_walk(sp->c, sp->n, b, sp->from, b->len);
+  const size_t drop = b->len > sp->keep ? (b->len - sp->keep) / 4 : 0;
+  sp->sum = sum_bytes(sp->sum, b->pk, drop);
+  memmove(b->pk, b->pk + drop, (b->len + 3) / 4 - drop);
+  b->len -= 4 * drop;
+  const size_t g = buf_gap(b, 4 * drop);
+  for (size_t i = 0; i < g; i++)
+    sp->gsum = sum_len(sp->gsum, sp->len + b->gap[i]);
+  for (size_t i = g; i < b->ngap; i++)
+    b->gap[i - g] = b->gap[i] - 4 * drop;
+  b->ngap -= g;
+  sp->ngap += g;
+  sp->len += 4 * drop;
+  sp->from = b->len;
+}
+
+/* as kset_count, reading path (stdin if NULL) itself and holding far
+ * tables to about budget bytes; the counts go to the index out, or a
+ * temporary one if NULL, and come back mapped */
+static void kset_spill(struct kset *s, const char *path, const unsigned *lens,
+                       int n, int canon, unsigned long long budget,
+                       const char *out)
+{
+  struct spill sp = { malloc((n ? n : 1) * sizeof *sp.c), 0, 0, 0, 0, 0,
+                      SUM_BASIS, SUM_BASIS };
+  struct buf seq, none = { NULL, 0, 0, NULL, 0, 0 };
+  struct stat st;
+  unsigned maxlen = 1, far = 0;
+  unsigned long long held = 0; /* by dense tables */
+  if (!sp.c)
+    perror("malloc"), exit(1);
+  for (int i = 0; i < n; i++) {
+    int seen = 0;
+    for (int j = 0; j < sp.n; j++)
+      seen |= sp.c[j].len == lens[i];
+    if (seen)
+      continue;
+    struct kcnt *c = sp.c + sp.n++;
+    const unsigned long long size = dna_combo(lens[i]) * sizeof *c->dense;
+    if (dna_combo(lens[i]) <= DENSE_MAX && held + size <= budget) {
+      kcnt_init(c, &none, lens[i], 1, canon);
+      held += size;
+    } else {
+      memset(c, 0, sizeof *c);
+      c->len = lens[i];
+      c->mask = dna_mask(c->len);
+      c->canon = canon;
+      far++;
+    }
+    maxlen = MAX(maxlen, lens[i]);
+  }
+  /* enough partitions that each fits, if the input's size says how many */
+  unsigned parts = PART_MAX;
+  if (path && !stat(path, &st) && S_ISREG(st.st_mode))
+    parts = (unsigned)MIN(PART_MAX, st.st_size * SPILL_COST / budget + 1);
+  parts = MAX(1, MIN(parts, PART_MAX / MAX(far, 1)));
+  for (int j = 0; j < sp.n; j++) {
+    if (sp.c[j].dense)
+      continue;
+    sp.c[j].parts = parts;
+    sp.c[j].part = calloc(parts, sizeof *sp.c[j].part);
+    if (!sp.c[j].part)
+      perror("calloc"), exit(1);
+    for (unsigned i = 0; i < parts; i++)
+      sp.c[j].part[i].f = spill_file();
+  }
+  sp.keep = maxlen - 1;
+  dna_seq3(&seq, path, spill_drain, &sp);
+  const size_t len = sp.len + seq.len;
+  for (size_t i = 0; i < seq.ngap; i++)
+    sp.gsum = sum_len(sp.gsum, sp.len + seq.gap[i]);
+  const unsigned long long sum =
+    sum_gaps(sum_len(sum_bytes(sp.sum, seq.pk, (seq.len + 3) / 4), len),
+             sp.gsum, sp.ngap + seq.ngap);
+  buf_free(&seq);
+
+  char tmp[PATH_MAX];
+  if (!out) {
+    const int fd = tmp_open(tmp);
+    if (fd < 0)
+      perror(tmp), exit(1);
+    close(fd);
+    out = tmp;
+  }
+  struct kidx_out o;
+  kidx_open(&o, out, sp.n);
+  for (int j = 0; j < sp.n; j++) {
+    struct kcnt *c = sp.c + j;
+    if (c->dense) {
+      kidx_dense(&o, c);
+      kcnt_free(c);
+      continue;
+    }
+    struct runs r = { spill_file(), NULL, 0, 0, 0 };
+    for (unsigned i = 0; i < c->parts; i++)
+      part_count(c->part + i, c->len, budget, 0, &r);
+    free(c->part);
+    kidx_merge(&o, c->len, &r, budget);
+    fclose(r.f);
+    free(r.v);
+  }
+  kidx_close(&o, len, sum, canon);
+  free(sp.c);
+  kset_load(s, out);
+  if (out == tmp)
+    unlink(tmp);
+}
+
+/* growable list of strings */
+struct list {
+  char **v;
+  int    n,
+         alloc;
+};
+
+static void list_add(struct list *l, char *s)
+{
+  if (l->n == l->alloc) {
+    l->alloc = MAX(16, l->alloc * 2);
+    l->v = realloc(l->v, l->alloc * sizeof *l->v);
+    if (!l->v)
+      perror("realloc"), exit(1);
+  }
+  l->v[l->n++] = s;
+}
+
+static void list_dup(struct list *l, const char *s)
+{
+  char *d = strdup(s);
+  if (!d)
+    perror("strdup"), exit(1);
+  list_add(l, d);
+}
+
+/* a query is 1 to 32 nucleotides of either case and nothing else */
+static void query_add(struct list *q, const char *dna)
+{
+  const size_t len = strlen(dna);
+  if (!len || len > 32 || strspn(dna, "ACGTacgt") != len)
+    fprintf(stderr, "kn: bad query '%s'\n", dna), exit(1);
+  list_dup(q, dna);
+}
+
+static void len_add(struct list *l, const char *s)
+{
+  char *end;
+  const long len = strtol(s, &end, 10);
+  if (*end || len < 1 || len > 32)
+    fprintf(stderr, "kn: bad len '%s'\n", s), exit(1);
+  list_dup(l, s);
+}
+
+/* queries one per line of path; blank lines are skipped */
+static void query_file(struct list *q, const char *path)
+{
+  FILE *f = fopen(path, "r");
+  char *line = NULL;
+  size_t alloc = 0;
+  ssize_t n;
+  if (!f)
+    perror(path), exit(1);
+  while ((n = getline(&line, &alloc, f)) > 0) {
+    while (n && ('\n' == line[n - 1] || '\r' == line[n - 1]))
+      line[--n] = '\0';
+    if (n)
+      query_add(q, line);
+  }
+  free(line);
+  fclose(f);
+}
+
+static void usage(void)
+{
+  fputs("usage: kn [-c] [-k len,...] [-n top] [-q kmer,...] [-Q file]"
+        " [-m mb] [-w index | -i index] [file]\n"
+        "  -c  count each kmer and its reverse complement as one\n"
+        "  -k  frequency tables for each len, 1..32 (default 1,2)\n"
+        "  -n  only the top most frequent of each table (default all)\n"
+        "  -q  count each kmer (default GGT,GGTA,GGTATT,GGTATTTTAATT,"
+        "GGTATTTTAATTTATAGT)\n"
+        "  -Q  count each kmer listed one per line in file\n"
+        "  -m  count large tables in about mb megabytes, spilling to\n"
+        "      $TMPDIR\n"
+        "  -w  also save the counts to index\n"
+        "  -i  answer from index instead of counting; a file given is\n"
+        "      checked against it\n", stderr);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
 {
-  static char buf[2][1024];
+  static const char *Match[] = {
+    "GGT", "GGTA", "GGTATT", "GGTATTTTAATT", "GGTATTTTAATTTATAGT"
+  };
+  struct list freq = { 0 }, q = { 0 };
+  const char *save = NULL, *load = NULL;
+  ptrdiff_t top = 0;
+  unsigned long long budget = 0;
+  int kgiven = 0, canon = 0, opt;
+  char *tok, *end;
+  while ((opt = getopt(argc, argv, "ck:m:n:q:Q:w:i:")) != -1) {
+    switch (opt) {
+    case 'c':
+      canon = 1;
+      break;
+    case 'k':
+      kgiven = 1;
+      for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+        len_add(&freq, tok);
+      break;
+    case 'm':
+      budget = strtoull(optarg, NULL, 10) << 20;
+      if (!budget)
+        usage();
+      break;
+    case 'n':
+      top = strtol(optarg, &end, 10);
+      if (*end || !*optarg || top < 0)
+        fprintf(stderr, "kn: bad top '%s'\n", optarg), exit(1);
+      break;
+    case 'q':
+      for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+        query_add(&q, tok);
+      break;
+    case 'Q':
+      query_file(&q, optarg);
+      break;
+    case 'w':
+      save = optarg;
+      break;
+    case 'i':
+      load = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind > 1 || (save && load))
+    usage();
+  if (!kgiven)
+    len_add(&freq, "1"), len_add(&freq, "2");
+  if (!q.n)
+    for (size_t i = 0; i < sizeof Match / sizeof Match[0]; i++)
+      query_add(&q, Match[i]);
+
+  /* every len counted at once: the frequency tables', then the queries' */
+  const int nlen = freq.n + q.n;
+  unsigned *lens = malloc(nlen * sizeof *lens);
+  if (!lens)
+    perror("malloc"), exit(1);
+  for (int i = 0; i < freq.n; i++)
+    lens[i] = (unsigned)atoi(freq.v[i]);
+  for (int i = 0; i < q.n; i++)
+    lens[freq.n + i] = (unsigned)strlen(q.v[i]);
+
   struct buf seq;
-  if (dna_seq3(&seq))
-  #pragma omp sections
-  {
-    frq(&seq, buf[0]);
-    cnt(&seq, buf[1]);
+  struct kset s;
+  if (load) {
+    kset_load(&s, load);
+    if (canon != s.canon)
+      fprintf(stderr, "kn: %s is %scanonical\n", load, s.canon ? "" : "not "),
+      exit(1);
+    if (optind < argc && (dna_seq3(&seq, argv[optind], NULL, NULL) != s.len ||
+                          buf_sum(&seq) != s.sum))
+      fprintf(stderr, "kn: %s does not index %s\n", load, argv[optind]),
+      exit(1);
+    for (int i = 0; i < nlen; i++)
+      if (!kset_get(&s, lens[i]))
+        fprintf(stderr, "kn: %s has no %u-mers\n", load, lens[i]), exit(1);
+  } else if (budget) {
+    kset_spill(&s, optind < argc ? argv[optind] : NULL, lens, nlen, canon,
+               budget, save);
+  } else {
+    dna_seq3(&seq, optind < argc ? argv[optind] : NULL, NULL, NULL);
+    kset_count(&s, &seq, lens, nlen, canon);
+    if (save)
+      kset_save(&s, save);
+  }
+  if (s.len) {
+    frq(&s, lens, freq.n, top, stdout);
+    cnt(&s, q.v, q.n, stdout);
   }
-  #pragma omp barrier
-  for (int i = 0; i < 2; i++)
-    fputs(buf[i], stdout);
+  kset_free(&s);
   return 0;
 }
@@ -0,0 +1,160 @@
+/*
+ * a hash table keyed by 2-bit packed k-mer codes
+ * caller must
+ *    pack keys; k <= 32 fits in one word
+ * caller should
+ *    estimate max keys in advance; past that the table doubles
+ *
+ * open addressing over cache line sized buckets: a probe touches one
+ * line and only spills into the next bucket when its own is full.
+ * a zero count marks an empty slot, so key 0 (AAA...) needs no sentinel
+ */
+
+#ifndef KT_H
+#define KT_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define KT_LINE   64
+#define KT_BUCKET (KT_LINE / sizeof(struct ktentry))
+
+struct ktentry {
+  unsigned long long key;
+  unsigned long      cnt;
+};
+
+union ktbucket {
+  struct ktentry e[KT_BUCKET];
+  char           line[KT_LINE];
+};
+
+struct kt {
+  union ktbucket *bkt;    /* line-aligned buckets */
+  void           *mem;    /* what to free() */
+  unsigned long   bktcnt,
+                  size,   /* occupied entries */
+                  limit;  /* size that triggers ktgrow */
+};
+
+static inline void ktalloc(struct kt *t, unsigned long n)
+{
+  t->mem = calloc(n + 1, sizeof *t->bkt);
+  if (!t->mem)
+    perror("calloc"), exit(1);
+  t->bkt = (union ktbucket *)(((size_t)t->mem + KT_LINE - 1) &
+                              ~(size_t)(KT_LINE - 1));
+  t->bktcnt = n;
+  t->size = 0;
+  /* load <= 80% keeps probe chains within a line or two */
+  t->limit = (unsigned long)((unsigned long long)n * KT_BUCKET * 4 / 5);
+}
+
+static inline void ktinit(struct kt *t, unsigned long long maxkeys)
+{
+  ktalloc(t, (unsigned long)((maxkeys + maxkeys / 4) / KT_BUCKET + 1));
+}
+
+static inline ptrdiff_t ktsize(const struct kt *t)
+{
+  return (ptrdiff_t)t->size;
+}
+
+static inline void ktfree(struct kt *t){ free(t->mem); }
+
+/* fibonacci hash; packed codes of neighbouring k-mers differ only in
+ * their low bits, so mix, then scale 32 hash bits onto [0, bktcnt) */
+static inline unsigned long kthash(const struct kt *t, unsigned long long key)
+{
+  unsigned long long h = (key * 0x9E3779B97F4A7C15ULL) >> 32;
+  return (unsigned long)((h * t->bktcnt) >> 32);
+}
+
+/* entry for key, or the empty slot where it belongs.
+ * compare the whole line without branching, then branch once on the
+ * result; a per-slot early exit mispredicts on nearly every probe */
+static inline struct ktentry * ktslot(const struct kt *t,
+                                      unsigned long long key)
+{
+  unsigned long idx = kthash(t, key);
+  for (;;) {
+    struct ktentry *e = t->bkt[idx].e;
+    unsigned m = 0;
+    for (unsigned i = 0; i < KT_BUCKET; i++)
+      m |= (unsigned)((e[i].key == key) | !e[i].cnt) << i;
+    if (m)
+      return e + __builtin_ctz(m);
+    if (++idx == t->bktcnt)
+      idx = 0;
+  }
+}
+
+static inline void ktprefetch(const struct kt *t, unsigned long long key)
+{
+  __builtin_prefetch(t->bkt + kthash(t, key), 1);
+}
+
+static inline struct ktentry * ktfind(const struct kt *t,
+                                      unsigned long long key)
+{
+  struct ktentry *e = ktslot(t, key);
+  return e->cnt ? e : NULL;
+}
+
+static inline void ktadd(struct kt *t, unsigned long long key,
+                         unsigned long cnt);
+
+/* rehash into twice the buckets; only reached when maxkeys was short */
+static inline void ktgrow(struct kt *t)
+{
+  struct kt old = *t;
+  ktalloc(t, old.bktcnt * 2);
+  for (unsigned long idx = 0; idx < old.bktcnt; idx++)
+    for (unsigned i = 0; i < KT_BUCKET; i++)
+      if (old.bkt[idx].e[i].cnt)
+        ktadd(t, old.bkt[idx].e[i].key, old.bkt[idx].e[i].cnt);
+  ktfree(&old);
+}
+
+static inline void ktadd(struct kt *t, unsigned long long key,
+                         unsigned long cnt)
+{
+  struct ktentry *e = ktslot(t, key);
+  if (!e->cnt) {
+    e->key = key;
+    e->cnt = cnt;
+    if (++t->size > t->limit)
+      ktgrow(t);
+    return;
+  }
+  e->cnt += cnt;
+}
+
+static inline void ktincr(struct kt *t, unsigned long long key)
+{
+  ktadd(t, key, 1);
+}
+
+/* copy every entry to v, which has room for ktsize(t); returns its end */
+static inline struct ktentry * ktcopy(const struct kt *t, struct ktentry *v)
+{
+  for (unsigned long idx = 0; idx < t->bktcnt; idx++)
+    for (unsigned i = 0; i < KT_BUCKET; i++)
+      if (t->bkt[idx].e[i].cnt)
+        *v++ = t->bkt[idx].e[i];
+  return v;
+}
+
+/* allocate a vector and populate with contents of hash table */
+static inline struct ktentry * kt2vec(const struct kt *t)
+{
+  if (!ktsize(t))
+    return NULL;
+  struct ktentry *v = malloc(ktsize(t) * sizeof *v);
+  ktcopy(t, v);
+  return v;
+}
+
+#endif
+
@@ -6,51 +6,104 @@
  * refactored by Ryan Flynn
  */
 
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* mremap, MADV_HUGEPAGE */
+#define _FILE_OFFSET_BITS 64
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define LINESZ    60
 #define OUTBUFSZ  1024 * 1024
+#define HUGESZ    2 * 1024 * 1024 /* x86 huge page */
+#define CHUNKSZ   256 * 1024 /* mapped input complemented per job */
+#define WINDOW    8          /* jobs in flight per worker thread */
+#define BLKSZ     256 * 1024 /* pipeline block */
+#define RINGSZ    16         /* blocks in flight between two stages */
+#define MIN(a,b)  ((a) < (b) ? (a) : (b))
+
+#ifndef RC_SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RC_SIMD   1
+#else
+#define RC_SIMD   0
+#endif
+#endif
+#if RC_SIMD
+#include <immintrin.h>
+#endif
 
 /*
+ * a record's sequence lines as read, complemented where they lie
  *  _ _ _ _ _ _ _ _ _ _
  * |_|_|_|_|_|_|_|_|_|_|
- * ^head           <-- ^wr (moves backwards)
+ * ^head   ^wr --> (moves forwards)
  * |<-- alloc bytes -->|
  */
 struct revbuf {
   size_t alloc;
   char  *head,
         *wr;
+  size_t col;     /* bytes since the last newline */
+  int    shrt,    /* a line shorter than LINESZ ended */
+         ragged;  /* lines aren't LINESZ wide up to a short last one */
 };
 
 #define buf_end(b)  ((b)->head + (b)->alloc)
 
 /*
- * grow buffer or die; adjust members appropriately
+ * from a huge page up, have transparent huge pages back buffer p:
+ * a multi-GB record otherwise takes a TLB miss every few KB
  */
-static inline void revbuf_grow(struct revbuf *b)
+static inline void revbuf_huge(char *p, size_t n)
 {
-  const char *old = b->head;
-  const size_t wrlen = buf_end(b) - b->wr;
-  b->alloc += OUTBUFSZ;
-  b->head = realloc(b->head, b->alloc);
-  assert(b->head && "realloc");
-  b->wr = memmove(buf_end(b) - wrlen,
-                  b->head + (b->wr - old), wrlen);
+#ifdef MADV_HUGEPAGE
+  if (n >= HUGESZ)
+    madvise(p, n, MADV_HUGEPAGE);
+#else
+  (void)p, (void)n;
+#endif
 }
 
 /*
- * for each byte in rd
- *   if has a complement
- *     decrease b->wr and write complement
+ * anonymous mapping of n bytes or die
  */
-static inline void revcomp(char *rd, struct revbuf *b)
+static char * revbuf_map(size_t n)
 {
-  static const char Rev[256] = {
+  char *p = mmap(NULL, n, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == p)
+    perror("mmap"), exit(1);
+  revbuf_huge(p, n);
+  return p;
+}
+
+/*
+ * grow buffer or die; adjust members appropriately.
+ * mremap moves pages rather than bytes, and doubling keeps the calls
+ * down to one per power of two
+ */
+static inline void revbuf_grow(struct revbuf *b)
+{
+  const size_t wrlen = b->wr - b->head;
+  b->head = mremap(b->head, b->alloc, b->alloc * 2, MREMAP_MAYMOVE);
+  if (MAP_FAILED == b->head)
+    perror("mremap"), exit(1);
+  b->alloc *= 2;
+  revbuf_huge(b->head, b->alloc);
+  b->wr = b->head + wrlen;
+}
+
+static const char Rev[256] = {
     ['A'] = 'T', ['a'] = 'T',
     ['B'] = 'V', ['b'] = 'V',
     ['C'] = 'G', ['c'] = 'G',
@@ -66,49 +119,704 @@ static inline void revcomp(char *rd, struct revbuf *b)
     ['V'] = 'B', ['v'] = 'B',
     ['W'] = 'W', ['w'] = 'W',
     ['Y'] = 'R', ['y'] = 'R'
-  };
-  while (*rd) {
-    char c = Rev[(unsigned char)(*rd++)];
-    if (c)
-      *--b->wr = c;
+};
+
+/*
+ * reverse-complement kernels:
+ *   dst[0..] = complements of src[n-1], src[n-2] .. src[0]
+ *   bytes without a complement (newlines, junk) are skipped
+ *   returns bytes written; never writes past dst + n
+ */
+static size_t rc_scalar(char *dst, const char *src, size_t n)
+{
+  char *w = dst;
+  while (n--) {
+    char c = Rev[(unsigned char)src[n]];
+    *w = c;
+    w += !!c;
+  }
+  return w - dst;
+}
+
+/*
+ * in-place kernels:
+ *   swap lo[t] and hi[-1-t] for t < k, complementing both
+ *   bytes without a complement become 0; returns whether there were any
+ */
+static int swap_scalar(char *lo, char *hi, size_t k)
+{
+  int bad = 0;
+  for (size_t t = 0; t < k; t++) {
+    const char c = Rev[(unsigned char)lo[t]];
+    lo[t] = Rev[(unsigned char)hi[-1-(ptrdiff_t)t]];
+    hi[-1-(ptrdiff_t)t] = c;
+    bad |= !lo[t] | !c;
+  }
+  return bad;
+}
+
+#if RC_SIMD
+/*
+ * every letter's complement is a lookup on its low 5 bits, upper or
+ * lower case alike: two 16-entry pshufb tables, '@'..'O' and 'P'..'_',
+ * built from Rev. anything outside 0x40..0x7f maps to 0
+ */
+static unsigned char RevLo[16], RevHi[16];
+/* Pack[m]: shuffle gathering the bytes of an 8 byte half whose bits are
+ * set in m to the front; how invalid bytes get squeezed out */
+static unsigned char Pack[256][8];
+
+__attribute__((target("ssse3")))
+static inline __m128i rc16(__m128i v, __m128i lo, __m128i hi)
+{
+  const __m128i idx = _mm_and_si128(v, _mm_set1_epi8(0x1f)),
+                sel = _mm_cmpeq_epi8(_mm_and_si128(idx, _mm_set1_epi8(0x10)),
+                                     _mm_set1_epi8(0x10)),
+                let = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(-64)),
+                                     _mm_set1_epi8(0x40));
+  __m128i c = _mm_or_si128(_mm_and_si128(sel, _mm_shuffle_epi8(hi, idx)),
+                           _mm_andnot_si128(sel, _mm_shuffle_epi8(lo, idx)));
+  c = _mm_and_si128(c, let);
+  return _mm_shuffle_epi8(c, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                          8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+/* store the 16 complements in c, squeezing out zeros; returns new end */
+__attribute__((target("ssse3")))
+static inline char * pack16(char *w, __m128i c)
+{
+  const unsigned ok = ~_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(c, _mm_setzero_si128())) & 0xffff;
+  if (0xffff == ok) {
+    _mm_storeu_si128((__m128i *)w, c);
+    return w + 16;
+  }
+  _mm_storel_epi64((__m128i *)w, _mm_shuffle_epi8(c,
+    _mm_loadl_epi64((const __m128i *)Pack[ok & 0xff])));
+  w += __builtin_popcount(ok & 0xff);
+  _mm_storel_epi64((__m128i *)w, _mm_shuffle_epi8(_mm_srli_si128(c, 8),
+    _mm_loadl_epi64((const __m128i *)Pack[ok >> 8])));
+  return w + __builtin_popcount(ok >> 8);
+}
+
+__attribute__((target("ssse3")))
+static size_t rc_ssse3(char *dst, const char *src, size_t n)
+{
+  const __m128i lo = _mm_loadu_si128((const __m128i *)RevLo),
+                hi = _mm_loadu_si128((const __m128i *)RevHi);
+  char *w = dst;
+  for (; n >= 16; n -= 16)
+    w = pack16(w, rc16(_mm_loadu_si128((const __m128i *)(src + n - 16)),
+                       lo, hi));
+  return (w - dst) + rc_scalar(w, src, n);
+}
+
+__attribute__((target("ssse3")))
+static int swap_ssse3(char *lo, char *hi, size_t k)
+{
+  const __m128i l = _mm_loadu_si128((const __m128i *)RevLo),
+                h = _mm_loadu_si128((const __m128i *)RevHi);
+  __m128i zero = _mm_setzero_si128();
+  for (; k >= 16; k -= 16, lo += 16, hi -= 16) {
+    const __m128i a = rc16(_mm_loadu_si128((const __m128i *)lo), l, h),
+                  b = rc16(_mm_loadu_si128((const __m128i *)(hi - 16)), l, h);
+    _mm_storeu_si128((__m128i *)lo, b);
+    _mm_storeu_si128((__m128i *)(hi - 16), a);
+    zero = _mm_or_si128(zero, _mm_or_si128(
+             _mm_cmpeq_epi8(a, _mm_setzero_si128()),
+             _mm_cmpeq_epi8(b, _mm_setzero_si128())));
+  }
+  if (k && hi - lo >= 32) {
+    /* short run: swap whole vectors, keeping the bytes past k as they
+     * were; apart by 32, the two ends can't overlap */
+    static const char Ones[48] = { [16] = -1, -1, -1, -1, -1, -1, -1, -1,
+                                   -1, -1, -1, -1, -1, -1, -1, -1 };
+    const __m128i ml = _mm_loadu_si128((const __m128i *)(Ones + 32 - k)),
+                  mh = _mm_loadu_si128((const __m128i *)(Ones + k)),
+                  va = _mm_loadu_si128((const __m128i *)lo),
+                  vb = _mm_loadu_si128((const __m128i *)(hi - 16)),
+                  a = _mm_and_si128(mh, rc16(va, l, h)),
+                  b = _mm_and_si128(ml, rc16(vb, l, h));
+    _mm_storeu_si128((__m128i *)lo, _mm_or_si128(b, _mm_andnot_si128(ml, va)));
+    _mm_storeu_si128((__m128i *)(hi - 16),
+                     _mm_or_si128(a, _mm_andnot_si128(mh, vb)));
+    zero = _mm_or_si128(zero, _mm_or_si128(
+             _mm_and_si128(mh, _mm_cmpeq_epi8(a, _mm_setzero_si128())),
+             _mm_and_si128(ml, _mm_cmpeq_epi8(b, _mm_setzero_si128()))));
+    k = 0;
+  }
+  return (0 != _mm_movemask_epi8(zero)) | swap_scalar(lo, hi, k);
+}
+
+__attribute__((target("avx2")))
+static size_t rc_avx2(char *dst, const char *src, size_t n)
+{
+  const __m128i lo = _mm_loadu_si128((const __m128i *)RevLo),
+                hi = _mm_loadu_si128((const __m128i *)RevHi);
+  const __m256i lo2 = _mm256_broadcastsi128_si256(lo),
+                hi2 = _mm256_broadcastsi128_si256(hi),
+                rev = _mm256_broadcastsi128_si256(
+                        _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                     8, 9, 10, 11, 12, 13, 14, 15));
+  char *w = dst;
+  for (; n >= 32; n -= 32) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(src + n - 32)),
+                  idx = _mm256_and_si256(v, _mm256_set1_epi8(0x1f)),
+                  sel = _mm256_cmpeq_epi8(
+                          _mm256_and_si256(idx, _mm256_set1_epi8(0x10)),
+                          _mm256_set1_epi8(0x10)),
+                  let = _mm256_cmpeq_epi8(
+                          _mm256_and_si256(v, _mm256_set1_epi8(-64)),
+                          _mm256_set1_epi8(0x40));
+    __m256i c = _mm256_blendv_epi8(_mm256_shuffle_epi8(lo2, idx),
+                                   _mm256_shuffle_epi8(hi2, idx), sel);
+    c = _mm256_and_si256(c, let);
+    /* reverse within each lane, then swap lanes */
+    c = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(c, rev), 0x4e);
+    if (!_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_setzero_si256()))) {
+      _mm256_storeu_si256((__m256i *)w, c);
+      w += 32;
+    } else {
+      w = pack16(w, _mm256_castsi256_si128(c));
+      w = pack16(w, _mm256_extracti128_si256(c, 1));
+    }
   }
+  return (w - dst) + rc_ssse3(w, src, n);
 }
+#endif
+
+static size_t (*rc_kernel)(char *, const char *, size_t) = rc_scalar;
+static int (*rc_swap)(char *, char *, size_t) = swap_scalar;
 
 /*
- * format and write each line of LINESZ or fewer bytes
+ * pick the widest kernel this CPU runs; RC_KERNEL=scalar|ssse3|avx2 in
+ * the environment caps it, for comparison
  */
-static inline void output(struct revbuf *b)
+static void rc_init(void)
 {
-  char *pq = b->head;
-  while (b->wr < buf_end(b)) {
-    size_t len = LINESZ < buf_end(b) - b->wr ?
-                 LINESZ : buf_end(b) - b->wr;
-    memmove(pq, b->wr, len); /* move l to free space */
-    b->wr += len;
-    pq += len;
-    *pq++ = '\n';
+#if RC_SIMD
+  const char *want = getenv("RC_KERNEL");
+  for (int i = 0; i < 32; i++)
+    (i < 16 ? RevLo : RevHi)[i & 15] = (unsigned char)Rev['@' + i];
+  for (int m = 0; m < 256; m++)
+    for (int i = 0, k = 0; i < 8; i++)
+      Pack[m][i] = 0x80, Pack[m][k] = (unsigned char)i, k += m >> i & 1;
+  __builtin_cpu_init();
+  if (want && !strcmp(want, "scalar"))
+    return;
+  if (__builtin_cpu_supports("ssse3"))
+    rc_kernel = rc_ssse3, rc_swap = swap_ssse3;
+  if (want && !strcmp(want, "ssse3"))
+    return;
+  if (__builtin_cpu_supports("avx2"))
+    rc_kernel = rc_avx2;
+#endif
+}
+
+/*
+ * stages hand blocks to each other through bounded rings: the reader
+ * fills input blocks while the main thread complements, and a writer
+ * drains output blocks. every block starts out in its pipe's free ring
+ * and goes round free -> full -> free, so a stage that gets ahead waits
+ */
+struct blk {
+  const char *p;         /* bytes to write; NULL ends the stream */
+  size_t      len;
+  char        buf[BLKSZ];
+};
+
+struct ring {
+  pthread_mutex_t mu;
+  pthread_cond_t  cv;
+  struct blk     *slot[RINGSZ];
+  unsigned        head,  /* next to pop */
+                  tail,  /* next to push */
+                  done;  /* popped and finished with */
+};
+
+struct pipe {
+  struct ring free, full;
+  struct blk  blk[RINGSZ];
+};
+
+static struct pipe In, Out;
+
+static void ring_push(struct ring *r, struct blk *b)
+{
+  pthread_mutex_lock(&r->mu);
+  while (r->tail - r->head == RINGSZ)
+    pthread_cond_wait(&r->cv, &r->mu);
+  r->slot[r->tail++ % RINGSZ] = b;
+  pthread_cond_broadcast(&r->cv);
+  pthread_mutex_unlock(&r->mu);
+}
+
+static struct blk * ring_pop(struct ring *r)
+{
+  pthread_mutex_lock(&r->mu);
+  while (r->tail == r->head)
+    pthread_cond_wait(&r->cv, &r->mu);
+  struct blk *b = r->slot[r->head++ % RINGSZ];
+  pthread_cond_broadcast(&r->cv);
+  pthread_mutex_unlock(&r->mu);
+  return b;
+}
+
+/* consumer finished with the block it last popped */
+static void ring_done(struct ring *r)
+{
+  pthread_mutex_lock(&r->mu);
+  r->done++;
+  pthread_cond_broadcast(&r->cv);
+  pthread_mutex_unlock(&r->mu);
+}
+
+/* wait until the consumer has finished with everything pushed */
+static void ring_sync(struct ring *r)
+{
+  pthread_mutex_lock(&r->mu);
+  while (r->done != r->tail)
+    pthread_cond_wait(&r->cv, &r->mu);
+  pthread_mutex_unlock(&r->mu);
+}
+
+static void pipe_init(struct pipe *q)
+{
+  struct ring r = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                    { 0 }, 0, 0, 0 };
+  q->free = q->full = r;
+  for (unsigned i = 0; i < RINGSZ; i++)
+    ring_push(&q->free, q->blk + i);
+}
+
+static void * reader(void *arg)
+{
+  (void)arg;
+  for (;;) {
+    struct blk *b = ring_pop(&In.free);
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, b->buf, BLKSZ)) < 0 && EINTR == errno)
+      ;
+    if (n < 0)
+      perror("read"), exit(1);
+    b->p = n ? b->buf : NULL;
+    b->len = n;
+    ring_push(&In.full, b);
+    if (!n)
+      return NULL;
+  }
+}
+
+static void * writer(void *arg)
+{
+  (void)arg;
+  for (;;) {
+    struct blk *b = ring_pop(&Out.full);
+    if (!b->p)
+      return ring_done(&Out.full), NULL;
+    fwrite(b->p, 1, b->len, stdout);
+    ring_done(&Out.full);
+    ring_push(&Out.free, b);
   }
-  fwrite(b->head, 1, pq - b->head, stdout);
 }
 
-int main(void)
+/*
+ * line-wrapping output, staged in Out's blocks for the writer thread
+ */
+struct wrap {
+  char       *pq;
+  size_t      col;
+  struct blk *cur;
+  pthread_t   writer;
+};
+
+static void wrap_init(struct wrap *w)
 {
-  struct revbuf b = { OUTBUFSZ, malloc(OUTBUFSZ), 0 };
-  char l[LINESZ+1];
-  char *rd = fgets(l, sizeof l, stdin);
-  
-  assert("Buffer allocation" && b.head);
-  assert("No input data" && rd);
-  assert("First char not '>'" && '>' == *l);
-  b.wr = buf_end(&b);
-  while (rd) {
-    fputs(l, stdout); /* print id */
-    while ((rd = fgets(l, sizeof l, stdin)) && '>' != *l) {
-      if (b.wr <= b.head + sizeof l)
-        revbuf_grow(&b);
-      revcomp(l, &b);
+  pipe_init(&Out);
+  pthread_create(&w->writer, NULL, writer, NULL);
+  w->cur = ring_pop(&Out.free);
+  w->pq = w->cur->buf;
+  w->col = 0;
+}
+
+static void wrap_flush(struct wrap *w)
+{
+  if (w->pq == w->cur->buf)
+    return;
+  w->cur->p = w->cur->buf;
+  w->cur->len = w->pq - w->cur->buf;
+  ring_push(&Out.full, w->cur);
+  w->cur = ring_pop(&Out.free);
+  w->pq = w->cur->buf;
+}
+
+/* write p as is, e.g. an id line */
+static void wrap_raw(struct wrap *w, const char *p, size_t n)
+{
+  while (n) {
+    size_t len = MIN(n, (size_t)(w->cur->buf + BLKSZ - w->pq));
+    memcpy(w->pq, p, len);
+    w->pq += len, p += len, n -= len;
+    if (w->pq == w->cur->buf + BLKSZ)
+      wrap_flush(w);
+  }
+}
+
+/* have the writer write p where it lies; p must stay put until wrap_sync */
+static void wrap_ref(struct wrap *w, const char *p, size_t n)
+{
+  wrap_flush(w);
+  struct blk *b = ring_pop(&Out.free);
+  b->p = p;
+  b->len = n;
+  ring_push(&Out.full, b);
+}
+
+static void wrap_sync(struct wrap *w)
+{
+  wrap_flush(w);
+  ring_sync(&Out.full);
+}
+
+static void wrap_close(struct wrap *w)
+{
+  wrap_flush(w);
+  w->cur->p = NULL;
+  ring_push(&Out.full, w->cur);
+  pthread_join(w->writer, NULL);
+}
+
+/* continue the current sequence with t, a newline every LINESZ bytes */
+static void wrap_seq(struct wrap *w, const char *t, size_t m)
+{
+  while (m) {
+    size_t len = LINESZ - w->col < m ? LINESZ - w->col : m;
+    memcpy(w->pq, t, len);
+    w->pq += len, t += len, m -= len, w->col += len;
+    if (LINESZ == w->col)
+      *w->pq++ = '\n', w->col = 0;
+    if (w->pq > w->cur->buf + BLKSZ - LINESZ - 1)
+      wrap_flush(w);
+  }
+}
+
+/* end the current sequence's last, short line */
+static void wrap_end(struct wrap *w)
+{
+  if (w->col)
+    *w->pq++ = '\n', w->col = 0;
+}
+
+/*
+ * append n bytes of a line to the sequence in b, the last byte its
+ * newline if the line ends here, noting whether the lines so far are
+ * already laid out the way output wants them
+ */
+static inline void append(const char *p, size_t n, struct revbuf *b)
+{
+  size_t len = n - ('\n' == p[n-1]);
+  b->ragged |= len && b->shrt;
+  b->col += len;
+  if (len < n) {
+    b->ragged |= !b->col || b->col > LINESZ;
+    b->shrt = b->col < LINESZ;
+    b->col = 0;
+  }
+  memcpy(b->wr, p, n);
+  b->wr += n;
+}
+
+/*
+ * reverse-complement [lo, hi) in place, swapping from both ends towards
+ * the middle a run of bytes at a time and stepping over the newlines
+ * between runs, which stay where they are.
+ * bytes with no complement become 0; returns whether there were any
+ */
+static inline int rc_inplace(char *lo, char *hi)
+{
+  int bad = 0;
+  for (;;) {
+    while (lo < hi && '\n' == *lo)
+      lo++;
+    while (lo < hi && '\n' == hi[-1])
+      hi--;
+    if (hi - lo < 2)
+      break;
+    /* runs up to the next newline from either end, looking no further
+     * than a line's width; a long line is just taken in pieces */
+    const ptrdiff_t win = MIN(hi - lo, LINESZ + 1);
+    const char *nl = memchr(lo, '\n', win), *p = hi - win, *q;
+    while ((q = memchr(p, '\n', hi - p)))
+      p = q + 1;
+    size_t k = MIN((size_t)(nl ? nl - lo : win), (size_t)(hi - p));
+    k = MIN(k, (size_t)(hi - lo) / 2);
+    bad |= rc_swap(lo, hi, k);
+    lo += k, hi -= k;
+  }
+  if (lo < hi)
+    bad |= !(*lo = Rev[(unsigned char)*lo]);
+  return bad;
+}
+
+/*
+ * complement b's sequence. lines LINESZ wide but for a shorter last one
+ * are complemented in place, newlines mirrored onto the same spots, and
+ * handed to the writer as they are; wrap_sync before touching b again.
+ * other layouts go a chunk at a time through w, the kernel dropping the
+ * newlines. either way b is the only copy
+ */
+static inline void output(struct wrap *w, struct revbuf *b)
+{
+  static char tmp[CHUNKSZ];
+  if (b->col) { /* unterminated last line */
+    b->ragged |= b->col > LINESZ;
+    *b->wr++ = '\n';
+  }
+  if (!b->ragged && !rc_inplace(b->head, b->wr)) {
+    wrap_ref(w, b->head, b->wr - b->head);
+  } else if (!b->ragged) { /* junk, now zeros */
+    char *q = b->head;
+    for (const char *p = b->head; p < b->wr; p++)
+      if (*p && '\n' != *p)
+        *q++ = *p;
+    wrap_seq(w, b->head, q - b->head);
+    wrap_end(w);
+  } else {
+    for (const char *hi = b->wr, *lo; hi > b->head; hi = lo) {
+      lo = hi - b->head > CHUNKSZ ? hi - CHUNKSZ : b->head;
+      wrap_seq(w, tmp, rc_kernel(tmp, lo, hi - lo));
+    }
+    wrap_end(w);
+  }
+  b->wr = b->head;
+  b->col = 0;
+  b->shrt = b->ragged = 0;
+}
+
+/*
+ * a mapped record is cut into jobs of at most CHUNKSZ input bytes, listed
+ * in output order: the record's id goes with its first job, and jobs run
+ * from the end of the sequence to the start. each complements its span
+ * on its own; only wrapping the results into lines is sequential
+ */
+struct job {
+  const char *id, *lo, *hi;
+  size_t      idlen, len;
+  char       *out;
+  int         end,  /* last job of its record */
+              done;
+};
+
+/* append the jobs for every record in [p, end) to *job */
+static size_t map_jobs(const char *p, const char *end, struct job **job)
+{
+  size_t n = 0, alloc = 64;
+  *job = malloc(alloc * sizeof **job);
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p),
+               *seq = nl ? nl + 1 : end,
+               *next = seq,
+               *hi;
+    while ((next = memchr(next, '>', end - next)) && '\n' != next[-1])
+      next++;
+    if (!next)
+      next = end;
+    hi = next;
+    do {
+      if (n == alloc)
+        *job = realloc(*job, (alloc *= 2) * sizeof **job);
+      if (!*job)
+        perror("realloc"), exit(1);
+      struct job *j = *job + n++;
+      memset(j, 0, sizeof *j);
+      j->hi = hi;
+      j->lo = hi - seq > CHUNKSZ ? hi - CHUNKSZ : seq;
+      if (hi == next)
+        j->id = p, j->idlen = seq - p;
+      j->end = j->lo == seq;
+      hi = j->lo;
+    } while (hi > seq);
+    p = next;
+  }
+  return n;
+}
+
+static void job_write(struct wrap *w, const struct job *j)
+{
+  if (j->id)
+    wrap_raw(w, j->id, j->idlen); /* print id */
+  wrap_seq(w, j->out, j->len);
+  if (j->end)
+    wrap_end(w);
+}
+
+/*
+ * workers take jobs in order and complement them; the main thread writes
+ * them out in the same order as each finishes. workers stay at most
+ * WINDOW jobs ahead of the writer, bounding buffered output
+ */
+struct pool {
+  pthread_mutex_t mu;
+  pthread_cond_t  cv;       /* a job finished, or the writer moved on */
+  struct job     *job;
+  size_t          njob,
+                  next,     /* job to take */
+                  written,  /* jobs written */
+                  window;
+};
+
+static void * worker(void *arg)
+{
+  struct pool *p = arg;
+  for (;;) {
+    pthread_mutex_lock(&p->mu);
+    while (p->next < p->njob && p->next >= p->written + p->window)
+      pthread_cond_wait(&p->cv, &p->mu);
+    if (p->next == p->njob) {
+      pthread_mutex_unlock(&p->mu);
+      return NULL;
+    }
+    struct job *j = p->job + p->next++;
+    pthread_mutex_unlock(&p->mu);
+    j->out = malloc(j->hi - j->lo + 1);
+    if (!j->out)
+      perror("malloc"), exit(1);
+    j->len = rc_kernel(j->out, j->lo, j->hi - j->lo);
+    pthread_mutex_lock(&p->mu);
+    j->done = 1;
+    pthread_cond_broadcast(&p->cv);
+    pthread_mutex_unlock(&p->mu);
+  }
+}
+
+static void pool_run(struct wrap *w, struct job *job, size_t njob,
+                     unsigned threads)
+{
+  struct pool p = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                    job, njob, 0, 0, WINDOW * threads };
+  pthread_t *t = malloc(threads * sizeof *t);
+  for (unsigned i = 0; i < threads; i++)
+    pthread_create(t + i, NULL, worker, &p);
+  for (size_t i = 0; i < njob; i++) {
+    pthread_mutex_lock(&p.mu);
+    while (!job[i].done)
+      pthread_cond_wait(&p.cv, &p.mu);
+    pthread_mutex_unlock(&p.mu);
+    job_write(w, job + i);
+    free(job[i].out);
+    pthread_mutex_lock(&p.mu);
+    p.written = i + 1;
+    pthread_cond_broadcast(&p.cv);
+    pthread_mutex_unlock(&p.mu);
+  }
+  for (unsigned i = 0; i < threads; i++)
+    pthread_join(t[i], NULL);
+  free(t);
+}
+
+/*
+ * map the named file and reverse-complement each record straight from the
+ * mapping; records end at the next line starting with '>'
+ */
+static int map_main(const char *path, unsigned threads)
+{
+  static struct wrap w;
+  static char tmp[CHUNKSZ];
+  struct job *job;
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st))
+    perror(path), exit(1);
+  assert("No input data" && st.st_size > 0);
+  const char *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (MAP_FAILED == m)
+    perror("mmap"), exit(1);
+  assert("First char not '>'" && '>' == *m);
+  posix_madvise((void *)m, st.st_size, POSIX_MADV_SEQUENTIAL);
+  wrap_init(&w);
+  size_t njob = map_jobs(m, m + st.st_size, &job);
+  if (threads > 1) {
+    pool_run(&w, job, njob, threads);
+  } else {
+    for (size_t i = 0; i < njob; i++) {
+      job[i].out = tmp;
+      job[i].len = rc_kernel(tmp, job[i].lo, job[i].hi - job[i].lo);
+      job_write(&w, job + i);
+    }
+  }
+  wrap_close(&w);
+  free(job);
+  munmap((void *)m, st.st_size);
+  close(fd);
+  return 0;
+}
+
+/*
+ * usage: rc [-j threads] [file]
+ * reads stdin unless given a file, which is mapped and complemented on
+ * threads workers, by default one per CPU
+ */
+int main(int argc, char *argv[])
+{
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while (-1 != (opt = getopt(argc, argv, "j:")))
+    if ('j' == opt)
+      threads = atol(optarg);
+    else
+      return fprintf(stderr, "usage: %s [-j threads] [file]\n", argv[0]), 1;
+  rc_init();
+  if (optind < argc)
+    return map_main(argv[optind], threads > 0 ? (unsigned)threads : 1);
+
+  /*
+   * stdin: a reader thread reads blocks, this thread splits them into
+   * lines and complements each record once it has all of it, and the
+   * writer thread writes
+   */
+  static struct wrap w;
+  struct revbuf b = { OUTBUFSZ, revbuf_map(OUTBUFSZ), 0, 0, 0, 0 };
+  enum { ID, SEQ } state = ID;
+  int bol = 1, first = 1, pending = 0;
+  pthread_t rd;
+
+  b.wr = b.head;
+  pipe_init(&In);
+  pthread_create(&rd, NULL, reader, NULL);
+  wrap_init(&w);
+  for (;;) {
+    struct blk *k = ring_pop(&In.full);
+    if (!k->p)
+      break;
+    const char *p = k->buf, *end = p + k->len;
+    assert("First char not '>'" && (!first || '>' == *p));
+    first = 0;
+    while (p < end) {
+      if (SEQ == state && bol && '>' == *p) {
+        output(&w, &b);
+        pending = 1;
+        state = ID;
+      }
+      const char *nl = memchr(p, '\n', end - p), *e = nl ? nl + 1 : end;
+      if (ID == state) {
+        wrap_raw(&w, p, e - p); /* print id */
+        state = nl ? SEQ : ID;
+      } else {
+        if (pending) /* writer may still be on the last record */
+          wrap_sync(&w), pending = 0;
+        while (buf_end(&b) - b.wr <= e - p)
+          revbuf_grow(&b);
+        append(p, e - p, &b);
+      }
+      bol = !!nl;
+      p = e;
     }
-    output(&b);
+    ring_push(&In.free, k);
   }
+  assert("No input data" && !first);
+  if (SEQ == state)
+    output(&w, &b);
+  wrap_close(&w);
+  pthread_join(rd, NULL);
   return 0;
 }